@@ -1,37 +1,35 @@
 #ifndef _WIO_COLORS_H
 #define _WIO_COLORS_H
 
-#include <wlr/render/pass.h>
-
-static const struct wlr_render_color background = {
+static const float background[4] = {
 	0x77 / 255.0f, 0x77 / 255.0f, 0x77 / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color selection_box = {
+static const float selection_box[4] = {
 	0xFF / 255.0f, 0x0 / 255.0f, 0x0 / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color active_border = {
+static const float active_border[4] = {
 	0x50 / 255.0f, 0xA1 / 255.0f, 0xAD / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color inactive_border = {
+static const float inactive_border[4] = {
 	0x9C / 255.0f, 0xE9 / 255.0f, 0xE9 / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color menu_selected = {
+static const float menu_selected[4] = {
 	0x3D / 255.0f, 0x7D / 255.0f, 0x42 / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color menu_unselected = {
+static const float menu_unselected[4] = {
 	0xEB / 255.0f, 0xFF / 255.0f, 0xEC / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color menu_border = {
+static const float menu_border[4] = {
 	0x78 / 255.0f, 0xAD / 255.0f, 0x84 / 255.0f, 1.0f,
 };
 
-static const struct wlr_render_color surface = {
+static const float surface[4] = {
 	0xEE / 255.0f, 0xEE / 255.0f, 0xEE / 255.0f, 1.0f,
 };
 
@@ -1,6 +1,7 @@
 #ifndef _WIO_LAYERS_H
 #define _WIO_LAYERS_H
 #include <wlr/types/wlr_layer_shell_v1.h>
+#include <wlr/types/wlr_scene.h>
 #include <wayland-server.h>
 
 struct wio_server;
@@ -8,10 +9,10 @@ struct wio_server;
 struct wio_layer_surface {
 	struct wlr_layer_surface_v1 *layer_surface;
 	struct wio_server *server;
+	struct wlr_scene_layer_surface_v1 *scene;
 	struct wl_list link;
 
 	struct wl_listener destroy;
-	struct wl_listener map;
 	struct wl_listener surface_commit;
 	struct wl_listener output_destroy;
 
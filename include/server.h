@@ -8,17 +8,28 @@
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_keyboard.h>
+#include <wlr/types/wlr_keyboard_group.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_xcursor_manager.h>
+#include <wlr/types/wlr_xdg_activation_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/box.h>
 
 #define countof(array) (sizeof((array)) / sizeof((array)[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 static const int window_border = 5;
 
+enum wio_tearing_policy {
+	TEARING_NEVER = 0,
+	TEARING_FOCUSED, // when the focused view asks for it
+	TEARING_FULLSCREEN, // same, but only if that view is fullscreen
+};
+
 enum wio_input_state {
 	INPUT_STATE_NONE = 0,
 	INPUT_STATE_MENU,
@@ -38,6 +49,7 @@ struct wio_server {
 	struct wl_display *wl_display;
 
 	const char *cage, *term;
+	bool direct; // run the terminal as a client of wio, without cage
 
 	struct wlr_allocator *allocator;
 	struct wlr_backend *backend;
@@ -45,22 +57,52 @@ struct wio_server {
 	struct wlr_cursor *cursor;
 	struct wlr_output_layout *output_layout;
 	struct wlr_renderer *renderer;
-	struct wlr_render_pass *render_pass;
+	struct wlr_scene *scene;
+	struct wlr_scene_output_layout *scene_layout;
 	struct wlr_seat *seat;
 	struct wlr_xcursor_manager *cursor_mgr;
 	struct wlr_xdg_shell *xdg_shell;
 	struct wlr_layer_shell_v1 *layer_shell;
 	struct wlr_xdg_decoration_manager_v1 *xdg_decoration_manager;
+	struct wlr_xdg_activation_v1 *xdg_activation;
+	struct wlr_tearing_control_manager_v1 *tearing_control;
+	struct wlr_relative_pointer_manager_v1 *relative_pointer_manager;
+	struct wlr_pointer_constraints_v1 *pointer_constraints;
+	struct wlr_pointer_constraint_v1 *active_constraint;
+	struct wlr_keyboard_group *keyboard_group;
+	struct xkb_context *xkb_context; // shared by all keymaps
+	struct wio_keymap_job *keymap_job; // compiling the first keymap
 
 	struct wl_list outputs;
 	struct wl_list output_configs;
 	struct wl_list inputs;
 	struct wl_list pointers;
 	struct wl_list keyboards;
+	struct wl_list keymaps;
 	struct wl_list views;
 	struct wl_list new_views;
+	struct wl_list pool; // wio_view, started ahead of time and kept hidden
+	int pool_size;
+
+	// Scene trees, from bottom to top
+	struct wlr_scene_tree *background_tree;
+	struct wlr_scene_tree *layer_trees[4];
+	struct wlr_scene_tree *view_tree;
+	struct wlr_scene_tree *fullscreen_tree;
+
+	struct wl_event_source *hidden_frame_timer;
+	bool hidden_frame_armed;
+	struct wl_event_source *sigchld; // only used without pidfds
+
+	// Spatial hash of the bounding boxes of mapped views, see wio_view_at
+	struct wio_view_bucket {
+		struct wio_view **views;
+		size_t len, cap;
+	} view_index[1024];
+	uint64_t stack_seq; // bumped whenever a view is raised
 
 	struct wl_listener new_output;
+	struct wl_listener output_layout_change;
 	struct wl_listener new_input;
 	struct wl_listener cursor_motion;
 	struct wl_listener cursor_motion_absolute;
@@ -71,13 +113,24 @@ struct wio_server {
 	struct wl_listener xdg_shell_new_toplevel;
 	struct wl_listener new_layer_surface;
 	struct wl_listener new_toplevel_decoration;
+	struct wl_listener xdg_activation_request;
+	struct wl_listener new_pointer_constraint;
 
 	struct {
 		int x, y;
 		int width, height;
-		struct wlr_texture *active_textures[5];
-		struct wlr_texture *inactive_textures[5];
+		// Label sizes in layout coordinates
+		int label_width[5], label_height[5];
+		struct wl_list atlases;
+		struct wio_menu_atlas *atlas; // the one currently shown
+		struct wlr_box rows[5]; // relative to x, y
 		int selected;
+
+		struct wlr_scene_tree *tree;
+		struct wlr_scene_rect *background;
+		struct wlr_scene_rect *borders[4];
+		struct wlr_scene_rect *selection;
+		struct wlr_scene_buffer *items[5];
 	} menu;
 
 	struct {
@@ -85,9 +138,28 @@ struct wio_server {
 		struct wio_view *view;
 	} interactive;
 
+	// Pointer motion is handled once per pointer frame
+	bool motion_pending;
+	uint32_t motion_time;
+	const char *cursor_image; // NULL while a client sets the cursor
+
+	struct {
+		struct wlr_scene_tree *tree;
+		struct wlr_scene_rect *fill;
+		struct wlr_scene_rect *borders[4];
+	} selection;
+
 	enum wio_input_state input_state;
 };
 
+// The menu labels rasterised for one output scale
+struct wio_menu_atlas {
+	float scale;
+	struct wlr_buffer *active, *inactive;
+	struct wlr_fbox sources[5]; // where each label is, in buffer pixels
+	struct wl_list link;
+};
+
 struct wio_output {
 	struct wl_list link;
 
@@ -95,8 +167,28 @@ struct wio_output {
 	struct wlr_output *wlr_output;
 	struct wlr_output_state *wlr_output_state;
 	struct wl_list layers[4];
+	struct wlr_scene_output *scene_output;
+	struct wlr_scene_rect *background;
+
+	// Rendering is delayed until this long before the next vblank
+	int max_render_time; // ms, 0 to render right away, -1 to learn it
+	int64_t render_estimate_ns;
+	struct timespec last_present;
+	int refresh_ns;
+	struct wl_event_source *repaint_timer;
+	enum wio_tearing_policy tearing;
+
+	// Frame timing, gathered over the last few hundred presented frames
+	struct {
+		struct timespec committed;
+		uint32_t commit_seq;
+		int64_t render_ns, render_max_ns;
+		int64_t latency_ns, latency_max_ns;
+		unsigned int frames, missed;
+	} stats;
 
 	struct wl_listener frame;
+	struct wl_listener present;
 	struct wl_listener destroy;
 };
 
@@ -104,8 +196,19 @@ struct wio_output_config {
 	const char *name;
 	int x, y;
 	int width, height;
-	int scale;
+	float scale;
 	enum wl_output_transform transform;
+	int max_render_time;
+	int refresh; // mHz
+	bool adaptive_sync;
+	enum wio_tearing_policy tearing;
+	struct wl_list link;
+};
+
+// A compiled keymap, shared by all keyboards with the same rule names
+struct wio_keymap {
+	char *rules, *model, *layout, *variant, *options;
+	struct xkb_keymap *keymap;
 	struct wl_list link;
 };
 
@@ -117,21 +220,55 @@ struct wio_keyboard {
 
 	struct wl_listener modifiers;
 	struct wl_listener key;
+	struct wl_listener destroy;
 };
 
+struct wio_pointer_constraint {
+	struct wio_server *server;
+	struct wlr_pointer_constraint_v1 *constraint;
+
+	struct wl_listener set_region;
+	struct wl_listener destroy;
+};
+
+/*
+ * A window New has spawned but not yet placed. It is found through the
+ * activation token handed to the child, or by pid for clients that don't
+ * use it, and freed once its token expires.
+ */
 struct wio_new_view {
 	pid_t pid;
 	struct wlr_box box;
+	bool pooled;
+	struct wlr_xdg_activation_token_v1 *token;
+	// Activated before its initial commit, placed on that commit
+	struct wio_view *view;
 	struct wl_list link;
+	struct wl_listener token_destroy;
 };
 
 void server_new_output(struct wl_listener *listener, void *data);
+void server_output_layout_change(struct wl_listener *listener, void *data);
 void server_new_input(struct wl_listener *listener, void *data);
+void wio_keymap_prewarm(struct wio_server *server);
+void wio_create_keyboard_group(struct wio_server *server);
+void wio_fill_pool(struct wio_server *server);
 void server_cursor_motion(struct wl_listener *listener, void *data);
 void server_cursor_motion_absolute(struct wl_listener *listener, void *data);
 void server_cursor_button(struct wl_listener *listener, void *data);
 void server_cursor_axis(struct wl_listener *listener, void *data);
 void server_cursor_frame(struct wl_listener *listener, void *data);
 void seat_request_cursor(struct wl_listener *listener, void *data);
+void server_new_pointer_constraint(struct wl_listener *listener, void *data);
+
+void wio_create_borders(struct wlr_scene_tree *parent,
+		struct wlr_scene_rect *borders[static 4], const float color[static 4]);
+void wio_set_borders(struct wlr_scene_rect *borders[static 4],
+		int width, int height, const float color[static 4]);
+void wio_update_selection(struct wio_server *server);
+void wio_open_menu(struct wio_server *server, int x, int y);
+void wio_close_menu(struct wio_server *server);
+void wio_menu_select(struct wio_server *server);
+struct wio_menu_atlas *wio_menu_atlas_get(struct wio_server *server, float scale);
 
 #endif
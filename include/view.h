@@ -1,5 +1,6 @@
 #ifndef _WIO_VIEW_H
 #define _WIO_VIEW_H
+#include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wayland-server.h>
 
@@ -19,15 +20,37 @@ enum wio_view_area {
 };
 
 struct wio_server;
+struct wio_new_view;
 
 struct wio_view {
 	int x, y;
+	// Border size and colour currently shown
+	int width, height;
+	bool activated;
     enum wio_view_area area;
 	struct wlr_xdg_toplevel *xdg_toplevel;
 	struct wio_server *server;
+	pid_t pid;
+	struct wio_new_view *placement; // token activated before the initial commit
 	struct wl_list link;
+	struct wlr_scene_tree *scene_tree;
+	struct wlr_scene_rect *borders[4];
+	bool fullscreen;
+	bool pooled; // waiting in server->pool to be claimed by New
+	// Claimed from the pool, shown once the client acks claim_serial
+	bool claiming;
+	uint32_t claim_serial;
+	bool opaque; // the surface has no translucent areas
+	bool occluded; // entirely hidden behind opaque views or offscreen
+	uint64_t outputs; // bitmask of the scene output indices the view is on
+	uint64_t stack; // higher is closer to the top
+	bool indexed;
+	struct wlr_box index_box; // bounding box the view is indexed under
+	struct wlr_box saved; // geometry to restore when leaving fullscreen
 	struct wl_listener map;
+	struct wl_listener unmap;
 	struct wl_listener commit;
+	struct wl_listener request_fullscreen;
 	struct wl_listener destroy;
 };
 
@@ -40,10 +63,21 @@ struct wio_decoration {
 
 void server_xdg_shell_new_toplevel(struct wl_listener *listener, void *data);
 void server_new_toplevel_decoration(struct wl_listener *listener, void *data);
+void server_xdg_activation_request(struct wl_listener *listener, void *data);
 void wio_view_focus(struct wio_view *view, struct wlr_surface *surface);
 struct wio_view *wio_view_at(struct wio_server *server, double lx, double ly,
 		struct wlr_surface **surface, double *sx, double *sy);
 void wio_view_move(struct wio_view *view, int x, int y);
+void wio_view_surface_origin(struct wio_view *view, struct wlr_surface *surface,
+		int *lx, int *ly);
+bool wio_pool_claim(struct wio_server *server, struct wlr_box box);
+struct wio_new_view *wio_new_view_create(struct wio_server *server,
+		struct wlr_box box, bool pooled);
+void wio_new_view_destroy(struct wio_new_view *new_view);
+void wio_update_occlusion(struct wio_server *server);
+void wio_update_view_outputs(struct wio_server *server);
+void wio_view_set_fullscreen(struct wio_view *view, bool fullscreen,
+		struct wlr_output *output);
 struct wlr_box wio_which_box(struct wio_server *server);
 struct wlr_box wio_canon_box(struct wio_server *server, struct wlr_box box);
 
@@ -1,9 +1,14 @@
-#define _POSIX_C_SOURCE 200811L
+#define _GNU_SOURCE
 
 #include <linux/input-event-codes.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -14,8 +19,12 @@
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_keyboard.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_pointer_constraints_v1.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
+#include <wlr/types/wlr_xdg_activation_v1.h>
 #include <wlr/util/box.h>
 #include <wlr/util/log.h>
+#include <wlr/util/region.h>
 #include <xkbcommon/xkbcommon.h>
 
 #include "server.h"
@@ -29,6 +38,18 @@ static char *corners[9] = {
 };
 static char *corner = NULL;
 
+extern char **environ;
+
+static void
+set_xcursor(struct wio_server *server, const char *name) {
+	// Setting the same image again would upload it to the cursor plane again
+	if (server->cursor_image && strcmp(server->cursor_image, name) == 0) {
+		return;
+	}
+	server->cursor_image = name;
+	wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, name);
+}
+
 static void
 change_vt(struct wio_server *server, unsigned int vt) {
 	if (!wlr_backend_is_multi(server->backend)) {
@@ -44,6 +65,11 @@ server_handle_shortcut(struct wl_listener *listener, struct wlr_keyboard_key_eve
 	struct wio_keyboard *keyboard = wl_container_of(listener, keyboard, key);
 	struct wio_server   *server   = keyboard->server;
 
+	if (!keyboard->wlr_keyboard->xkb_state) {
+		/* The keymap is still being compiled */
+		return false;
+	}
+
 	/* Translate libinput keycode -> xkbcommon */
 	uint32_t keycode = event->keycode + 8;
 	/* Get a list of keysyms based on the keymap for this keyboard */
@@ -89,35 +115,256 @@ keyboard_handle_key(struct wl_listener *listener, void *data) {
 }
 
 static void
-server_new_keyboard(struct wio_server *server, struct wlr_input_device *device) {
-	struct wlr_keyboard *wlr_keyboard = wlr_keyboard_from_input_device(device);
+keyboard_listen(struct wio_keyboard *keyboard) {
+	keyboard->modifiers.notify = keyboard_handle_modifiers;
+	wl_signal_add(&keyboard->wlr_keyboard->events.modifiers, &keyboard->modifiers);
+	keyboard->key.notify = keyboard_handle_key;
+	wl_signal_add(&keyboard->wlr_keyboard->events.key, &keyboard->key);
+}
 
+/*
+ * Keyboards sharing the group's keymap deliver their events through the
+ * group, so the seat keeps one keyboard and never re-sends the keymap to
+ * clients when another one is typed on. Only a keyboard with a different
+ * keymap stands on its own.
+ */
+static void
+keyboard_join_group(struct wio_keyboard *keyboard) {
+	struct wio_server *server = keyboard->server;
+	struct wlr_keyboard *group = &server->keyboard_group->keyboard;
+	if (!group->keymap) {
+		wlr_keyboard_set_keymap(group, keyboard->wlr_keyboard->keymap);
+	}
+	if (wlr_keyboard_group_add_keyboard(server->keyboard_group, keyboard->wlr_keyboard)) {
+		wlr_seat_set_keyboard(server->seat, group);
+		return;
+	}
+	keyboard_listen(keyboard);
+	wlr_seat_set_keyboard(server->seat, keyboard->wlr_keyboard);
+}
+
+void
+wio_create_keyboard_group(struct wio_server *server) {
+	server->keyboard_group = wlr_keyboard_group_create();
 	struct wio_keyboard *keyboard = calloc(1, sizeof(struct wio_keyboard));
 	keyboard->server = server;
-	keyboard->wlr_keyboard = wlr_keyboard;
+	keyboard->wlr_keyboard = &server->keyboard_group->keyboard;
+	wlr_keyboard_set_repeat_info(keyboard->wlr_keyboard, 25, 600);
+	keyboard_listen(keyboard);
+}
 
+struct wio_keymap_job {
+	struct wio_server *server;
+	/* Rule names copied on the main loop, the thread never reads the environment */
+	struct wio_keymap *cached;
+	pthread_t thread;
+	int fds[2];
+	struct wl_event_source *source;
+};
+
+static struct xkb_rule_names
+env_rule_names(void) {
 	struct xkb_rule_names rules = {0};
 	rules.rules   = getenv("XKB_DEFAULT_RULES");
 	rules.model   = getenv("XKB_DEFAULT_MODEL");
 	rules.layout  = getenv("XKB_DEFAULT_LAYOUT");
 	rules.variant = getenv("XKB_DEFAULT_VARIANT");
 	rules.options = getenv("XKB_DEFAULT_OPTIONS");
-	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_keymap  *keymap  = xkb_map_new_from_names(context, &rules,
-												         XKB_KEYMAP_COMPILE_NO_FLAGS);
+	return rules;
+}
 
-	wlr_keyboard_set_keymap(wlr_keyboard, keymap);
-	xkb_keymap_unref(keymap);
-	xkb_context_unref(context);
-	wlr_keyboard_set_repeat_info(wlr_keyboard, 25, 600);
+static bool
+str_equal(const char *a, const char *b) {
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
 
-	keyboard->modifiers.notify = keyboard_handle_modifiers;
-	wl_signal_add(&wlr_keyboard->events.modifiers, &keyboard->modifiers);
-	keyboard->key.notify = keyboard_handle_key;
-	wl_signal_add(&wlr_keyboard->events.key, &keyboard->key);
+static char *
+str_dup(const char *str) {
+	return str ? strdup(str) : NULL;
+}
+
+static struct wio_keymap *
+keymap_create(const struct xkb_rule_names *rules) {
+	struct wio_keymap *cached = calloc(1, sizeof(struct wio_keymap));
+	cached->rules   = str_dup(rules->rules);
+	cached->model   = str_dup(rules->model);
+	cached->layout  = str_dup(rules->layout);
+	cached->variant = str_dup(rules->variant);
+	cached->options = str_dup(rules->options);
+	return cached;
+}
+
+static void
+keymap_destroy(struct wio_keymap *cached) {
+	free(cached->rules);
+	free(cached->model);
+	free(cached->layout);
+	free(cached->variant);
+	free(cached->options);
+	free(cached);
+}
+
+static struct wio_keymap *
+keymap_cache_add(struct wio_server *server, const struct xkb_rule_names *rules,
+				 struct xkb_keymap *keymap) {
+	struct wio_keymap *cached = keymap_create(rules);
+	cached->keymap = keymap;
+	wl_list_insert(&server->keymaps, &cached->link);
+	return cached;
+}
+
+/*
+ * Returns the keymap for these rule names, compiling it on a miss. Returns
+ * NULL while the first keymap is still being compiled off the main loop.
+ */
+static struct xkb_keymap *
+keymap_get(struct wio_server *server, const struct xkb_rule_names *rules) {
+	struct wio_keymap *cached;
+	wl_list_for_each(cached, &server->keymaps, link) {
+		if (str_equal(cached->rules, rules->rules)
+				&& str_equal(cached->model, rules->model)
+				&& str_equal(cached->layout, rules->layout)
+				&& str_equal(cached->variant, rules->variant)
+				&& str_equal(cached->options, rules->options)) {
+			return cached->keymap;
+		}
+	}
+	if (server->keymap_job) {
+		/* The context belongs to the compiling thread until it's done */
+		return NULL;
+	}
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(server->xkb_context,
+			rules, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (!keymap) {
+		wlr_log(WLR_ERROR, "Unable to compile keymap");
+		return NULL;
+	}
+	return keymap_cache_add(server, rules, keymap)->keymap;
+}
 
-	wlr_seat_set_keyboard(server->seat, wlr_keyboard);
+static void *
+keymap_job_run(void *data) {
+	struct wio_keymap_job *job = data;
+	struct wio_keymap *cached = job->cached;
+	struct xkb_rule_names rules = {
+		.rules   = cached->rules,
+		.model   = cached->model,
+		.layout  = cached->layout,
+		.variant = cached->variant,
+		.options = cached->options,
+	};
+	cached->keymap = xkb_keymap_new_from_names(job->server->xkb_context,
+			&rules, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	char done = 1;
+	write(job->fds[1], &done, 1);
+	return NULL;
+}
+
+static int
+keymap_job_done(int fd, uint32_t mask, void *data) {
+	struct wio_keymap_job *job = data;
+	struct wio_server *server = job->server;
+	pthread_join(job->thread, NULL);
+	wl_event_source_remove(job->source);
+	close(job->fds[0]);
+	close(job->fds[1]);
+	server->keymap_job = NULL;
+
+	struct wio_keymap *cached = job->cached;
+	free(job);
+	if (!cached->keymap) {
+		wlr_log(WLR_ERROR, "Unable to compile keymap");
+		keymap_destroy(cached);
+		return 0;
+	}
+	struct xkb_keymap *keymap = cached->keymap;
+	wl_list_insert(&server->keymaps, &cached->link);
+	/* Hand it to the keyboards which showed up in the meantime */
+	struct wio_keyboard *keyboard;
+	wl_list_for_each(keyboard, &server->keyboards, link) {
+		if (!keyboard->wlr_keyboard->keymap) {
+			wlr_keyboard_set_keymap(keyboard->wlr_keyboard, keymap);
+			keyboard_join_group(keyboard);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compiling a keymap takes long enough to be noticed, so the one every
+ * keyboard is going to use is compiled on a thread, while wio starts up.
+ * Keyboards which appear before it is ready get it once it is.
+ */
+void
+wio_keymap_prewarm(struct wio_server *server) {
+	wl_list_init(&server->keymaps);
+	/*
+	 * The rule names are always passed in, from env_rule_names on the main
+	 * loop; otherwise libxkbcommon would read them on the compiling thread
+	 * while the main loop may be calling setenv.
+	 */
+	server->xkb_context = xkb_context_new(XKB_CONTEXT_NO_ENVIRONMENT_NAMES);
+
+	struct wio_keymap_job *job = calloc(1, sizeof(struct wio_keymap_job));
+	job->server = server;
+	if (pipe(job->fds) != 0) {
+		wlr_log(WLR_ERROR, "Unable to create pipe for keymap compilation");
+		free(job);
+		return;
+	}
+	struct xkb_rule_names rules = env_rule_names();
+	job->cached = keymap_create(&rules);
+	job->source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+			job->fds[0], WL_EVENT_READABLE, keymap_job_done, job);
+	if (pthread_create(&job->thread, NULL, keymap_job_run, job) != 0) {
+		wlr_log(WLR_ERROR, "Unable to start keymap compilation");
+		wl_event_source_remove(job->source);
+		close(job->fds[0]);
+		close(job->fds[1]);
+		keymap_destroy(job->cached);
+		free(job);
+		return;
+	}
+	server->keymap_job = job;
+}
+
+static void
+keyboard_handle_destroy(struct wl_listener *listener, void *data) {
+	struct wio_keyboard *keyboard = wl_container_of(listener, keyboard, destroy);
+	struct wio_server *server = keyboard->server;
+	/* The group drops its keyboards by itself */
+	wl_list_remove(&keyboard->modifiers.link);
+	wl_list_remove(&keyboard->key.link);
+	wl_list_remove(&keyboard->destroy.link);
+	wl_list_remove(&keyboard->link);
+	free(keyboard);
+	if (wl_list_empty(&server->keyboards)) {
+		wlr_seat_set_capabilities(server->seat, WL_SEAT_CAPABILITY_POINTER);
+	}
+}
+
+static void
+server_new_keyboard(struct wio_server *server, struct wlr_input_device *device) {
+	struct wlr_keyboard *wlr_keyboard = wlr_keyboard_from_input_device(device);
+
+	struct wio_keyboard *keyboard = calloc(1, sizeof(struct wio_keyboard));
+	keyboard->server = server;
+	keyboard->wlr_keyboard = wlr_keyboard;
+	/* Only listened to if it stays out of the group */
+	wl_list_init(&keyboard->modifiers.link);
+	wl_list_init(&keyboard->key.link);
+	keyboard->destroy.notify = keyboard_handle_destroy;
+	wl_signal_add(&device->events.destroy, &keyboard->destroy);
+
+	wlr_keyboard_set_repeat_info(wlr_keyboard, 25, 600);
 	wl_list_insert(&server->keyboards, &keyboard->link);
+
+	struct xkb_rule_names rules = env_rule_names();
+	struct xkb_keymap *keymap = keymap_get(server, &rules);
+	if (keymap) {
+		wlr_keyboard_set_keymap(wlr_keyboard, keymap);
+		keyboard_join_group(keyboard);
+	}
 }
 
 static void
@@ -155,6 +402,13 @@ process_cursor_motion(struct wio_server *server, uint32_t time) {
 	if (server->input_state == INPUT_STATE_NONE) {
 		view = wio_view_at(server, server->cursor->x, server->cursor->y, &surface, &sx, &sy);
 	}
+	// Otherwise only the cursor moves, which wlr_cursor puts on a hardware
+	// plane where it can and damages just its old and new spots where not
+	if (server->input_state == INPUT_STATE_MENU) {
+		wio_menu_select(server);
+	} else if (server->input_state != INPUT_STATE_NONE) {
+		wio_update_selection(server);
+	}
 	if (view) {
 		goto End;
 	}
@@ -163,24 +417,24 @@ process_cursor_motion(struct wio_server *server, uint32_t time) {
 	case INPUT_STATE_RESIZE_SELECT:
 	case INPUT_STATE_DELETE_SELECT:
 	case INPUT_STATE_HIDE_SELECT:
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "hand1");
+		set_xcursor(server, "hand1");
 		break;
 	case INPUT_STATE_MOVE:
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "grabbing");
+		set_xcursor(server, "grabbing");
 		break;
 	case INPUT_STATE_BORDER_DRAG:
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, corner);
+		set_xcursor(server, corner);
 		break;
 	case INPUT_STATE_RESIZE_START:
 	case INPUT_STATE_NEW_START:
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "top_left_corner");
+		set_xcursor(server, "top_left_corner");
 		break;
 	case INPUT_STATE_RESIZE_END:
 	case INPUT_STATE_NEW_END:
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "grabbing");
+		set_xcursor(server, "grabbing");
 		break;
 	default:
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "left_ptr");
+		set_xcursor(server, "left_ptr");
 		break;
  	}
 End:
@@ -193,46 +447,136 @@ End:
 		return;
 	}
 	if (view) {
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, corners[view->area]);
+		set_xcursor(server, corners[view->area]);
 	}
 	wlr_seat_pointer_clear_focus(seat);
 }
 
+static void
+set_pointer_constraint(struct wio_server *server, struct wlr_pointer_constraint_v1 *constraint) {
+	if (server->active_constraint == constraint) {
+		return;
+	}
+	if (server->active_constraint) {
+		wlr_pointer_constraint_v1_send_deactivated(server->active_constraint);
+	}
+	server->active_constraint = constraint;
+	if (constraint) {
+		wlr_pointer_constraint_v1_send_activated(constraint);
+	}
+}
+
+static void
+update_pointer_constraint(struct wio_server *server) {
+	// Constraints apply while their surface has pointer focus and the
+	// pointer is within their region, confining it elsewhere would freeze it
+	struct wlr_seat *seat = server->seat;
+	struct wlr_surface *surface = seat->pointer_state.focused_surface;
+	struct wlr_pointer_constraint_v1 *constraint = NULL;
+	if (surface) {
+		constraint = wlr_pointer_constraints_v1_constraint_for_surface(
+				server->pointer_constraints, surface, seat);
+	}
+	if (constraint && !pixman_region32_contains_point(&constraint->region,
+			floor(seat->pointer_state.sx), floor(seat->pointer_state.sy), NULL)) {
+		constraint = NULL;
+	}
+	set_pointer_constraint(server, constraint);
+}
+
+/*
+ * High-rate mice send many motion events per pointer frame; the cursor
+ * follows each of them, but hit-testing and everything after it only
+ * happens once, for where the cursor ended up.
+ */
+static void
+flush_cursor_motion(struct wio_server *server) {
+	if (server->motion_pending) {
+		server->motion_pending = false;
+		process_cursor_motion(server, server->motion_time);
+		update_pointer_constraint(server);
+	}
+}
+
+static void
+pointer_motion(struct wio_server *server, struct wlr_input_device *device, uint32_t time,
+			   double dx, double dy, double unaccel_dx, double unaccel_dy) {
+	// Clients get every delta, before any constraint applies to the cursor
+	wlr_relative_pointer_manager_v1_send_relative_motion(server->relative_pointer_manager,
+			server->seat, (uint64_t)time * 1000, dx, dy, unaccel_dx, unaccel_dy);
+
+	struct wlr_pointer_constraint_v1 *constraint = server->active_constraint;
+	if (constraint) {
+		if (constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) {
+			return;
+		}
+		// The region is in surface coordinates; the seat's are only current
+		// once pending motion has been hit-tested, at the end of the frame
+		double sx, sy;
+		struct wlr_xdg_toplevel *toplevel = wlr_xdg_toplevel_try_from_wlr_surface(
+				wlr_surface_get_root_surface(constraint->surface));
+		if (toplevel && toplevel->base->data) {
+			int ox, oy;
+			wio_view_surface_origin(toplevel->base->data, constraint->surface, &ox, &oy);
+			sx = server->cursor->x - ox;
+			sy = server->cursor->y - oy;
+		} else {
+			// Not in a view, e.g. a popup
+			flush_cursor_motion(server);
+			sx = server->seat->pointer_state.sx;
+			sy = server->seat->pointer_state.sy;
+		}
+		double confined_sx, confined_sy;
+		if (!wlr_region_confine(&constraint->region, sx, sy, sx + dx, sy + dy,
+				&confined_sx, &confined_sy)) {
+			return;
+		}
+		dx = confined_sx - sx;
+		dy = confined_sy - sy;
+	}
+	wlr_cursor_move(server->cursor, device, dx, dy);
+	server->motion_pending = true;
+	server->motion_time = time;
+}
+
 void
 server_cursor_motion(struct wl_listener *listener, void *data) {
 	struct wio_server *server = wl_container_of(listener, server, cursor_motion);
 	struct wlr_pointer_motion_event *event = data;
-	wlr_cursor_move(server->cursor, &event->pointer->base, event->delta_x, event->delta_y);
-	process_cursor_motion(server, event->time_msec);
+	pointer_motion(server, &event->pointer->base, event->time_msec,
+			event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy);
 }
 
 void
 server_cursor_motion_absolute( struct wl_listener *listener, void *data) {
 	struct wio_server *server = wl_container_of(listener, server, cursor_motion_absolute);
 	struct wlr_pointer_motion_absolute_event *event = data;
-	wlr_cursor_warp_absolute(server->cursor, &event->pointer->base, event->x, event->y);
-	process_cursor_motion(server, event->time_msec);
+	double lx, ly;
+	wlr_cursor_absolute_to_layout_coords(server->cursor, &event->pointer->base,
+			event->x, event->y, &lx, &ly);
+	double dx = lx - server->cursor->x, dy = ly - server->cursor->y;
+	pointer_motion(server, &event->pointer->base, event->time_msec, dx, dy, dx, dy);
 }
 
 static void
 menu_handle_button(struct wio_server *server, struct wlr_pointer_button_event *event) {
-	server->menu.x = server->menu.y = -1;
+	wio_close_menu(server);
 	switch (server->menu.selected) {
 	case 0:
 		server->input_state = INPUT_STATE_NEW_START;
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "grabbing");
+		set_xcursor(server, "grabbing");
 		break;
 	case 1:
 		server->input_state = INPUT_STATE_RESIZE_SELECT;
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "hand1");
+		set_xcursor(server, "hand1");
 		break;
 	case 2:
 		server->input_state = INPUT_STATE_MOVE_SELECT;
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "hand1");
+		set_xcursor(server, "hand1");
 		break;
 	case 3:
 		server->input_state = INPUT_STATE_DELETE_SELECT;
-		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "hand1");
+		set_xcursor(server, "hand1");
 		break;
 	default:
 		server->input_state = INPUT_STATE_NONE;
@@ -248,70 +592,187 @@ view_begin_interactive(struct wio_view *view, struct wlr_surface *surface, doubl
 	view->server->interactive.sx = (int)sx;
 	view->server->interactive.sy = (int)sy;
 	view->server->input_state = state;
-	wlr_cursor_set_xcursor(view->server->cursor, view->server->cursor_mgr, cursor);
+	set_xcursor(view->server, cursor);
 }
 
 static void
 view_end_interactive(struct wio_server *server) {
 	server->input_state = INPUT_STATE_NONE;
 	server->interactive.view = NULL;
+	// Also dismisses the menu when another button was clicked over it
+	wio_close_menu(server);
 	// TODO: Restore previous pointer?
-	wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "left_ptr");
+	set_xcursor(server, "left_ptr");
 }
 
+struct wio_child {
+	struct wio_server *server;
+	pid_t pid;
+	int pidfd;
+	struct wl_event_source *exit;
+};
+
 static void
-new_view(struct wio_server *server) {
-	struct wlr_box box = wio_which_box(server);
-	if (box.width < MINWIDTH || box.height < MINHEIGHT) {
-		return;
- 	}
-	struct wio_new_view *view = calloc(1, sizeof(struct wio_new_view));
-    view->box = box;
-	int fd[2];
-	if (pipe(fd) != 0) {
-		wlr_log(WLR_ERROR, "Unable to create pipe for fork");
+drop_new_view(struct wio_server *server, pid_t pid) {
+	struct wio_new_view *view, *tmp;
+	wl_list_for_each_safe(view, tmp, &server->new_views, link) {
+		if (view->pid == pid) {
+			/* Its window never showed up */
+			wio_new_view_destroy(view);
+		}
+	}
+}
+
+static int
+child_exit(int fd, uint32_t mask, void *data) {
+	struct wio_child *child = data;
+	waitpid(child->pid, NULL, WNOHANG);
+	drop_new_view(child->server, child->pid);
+	wl_event_source_remove(child->exit);
+	close(child->pidfd);
+	free(child);
+	return 0;
+}
+
+static int
+reap_children(int signal, void *data) {
+	struct wio_server *server = data;
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		drop_new_view(server, pid);
+	}
+	return 0;
+}
+
+static void
+watch_child(struct wio_server *server, pid_t pid) {
+	struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+#ifdef SYS_pidfd_open
+	int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd >= 0) {
+		struct wio_child *child = calloc(1, sizeof(struct wio_child));
+		child->server = server;
+		child->pid = pid;
+		child->pidfd = pidfd;
+		child->exit = wl_event_loop_add_fd(loop, pidfd, WL_EVENT_READABLE, child_exit, child);
 		return;
 	}
+#endif
+	/* No pidfds (older kernels, FreeBSD), reap on SIGCHLD instead */
+	if (!server->sigchld) {
+		server->sigchld = wl_event_loop_add_signal(loop, SIGCHLD, reap_children, server);
+	}
+}
+
+#define ACTIVATION_ENV "XDG_ACTIVATION_TOKEN="
+
+/*
+ * The environment with the window's activation token added, built rather
+ * than set with setenv so wio's own environment never carries a token.
+ */
+static char **
+spawn_env(const char *token) {
+	size_t n = 0;
+	while (environ[n]) {
+		n++;
+	}
+	char **envp = calloc(n + 2, sizeof(char *));
+	size_t len = strlen(ACTIVATION_ENV) + strlen(token) + 1;
+	envp[0] = malloc(len);
+	snprintf(envp[0], len, ACTIVATION_ENV "%s", token);
+	size_t j = 1;
+	for (size_t i = 0; i < n; i++) {
+		if (strncmp(environ[i], ACTIVATION_ENV, strlen(ACTIVATION_ENV)) != 0) {
+			envp[j++] = environ[i];
+		}
+	}
+	return envp;
+}
+
+static void
+free_spawn_env(char **envp) {
+	free(envp[0]);
+	free(envp);
+}
+
+/*
+ * posix_spawn() doesn't copy wio's address space, and the child's exit is
+ * noticed through the event loop, so nothing here blocks the compositor.
+ */
+static void
+spawn_view(struct wio_server *server, struct wlr_box box, bool pooled) {
 	char cmd[1024];
-	if (snprintf(cmd, sizeof(cmd), "%s -- %s", server->cage, server->term) >= (int)sizeof(cmd)) {
+	int len = server->direct
+		? snprintf(cmd, sizeof(cmd), "%s", server->term)
+		: snprintf(cmd, sizeof(cmd), "%s -- %s", server->cage, server->term);
+	if (len >= (int)sizeof(cmd)) {
 		fprintf(stderr, "New view command truncated\n");
 		return;
 	}
-	pid_t pid, child;
-	if ((pid = fork()) == 0) {
-		setsid();
-		sigset_t set;
-		sigemptyset(&set);
-		sigprocmask(SIG_SETMASK, &set, NULL);
-		close(fd[0]);
-		if ((child = fork()) == 0) {
-			close(fd[1]);
-			execl("/bin/sh", "/bin/sh", "-c", cmd, (void *)NULL);
-			_exit(0);
-		}
-		ssize_t s = 0;
-		while ((size_t)s < sizeof(pid_t)) {
-			s += write(fd[1], ((uint8_t *)&child) + s, sizeof(pid_t) - s);
-		}
-		close(fd[1]);
-		_exit(0); // Close child process
-	} else if (pid < 0) {
-		close(fd[0]);
-		close(fd[1]);
-		wlr_log(WLR_ERROR, "fork failed");
+
+	struct wio_new_view *view = wio_new_view_create(server, box, pooled);
+	if (!view) {
+		wlr_log(WLR_ERROR, "Unable to create an activation token");
 		return;
 	}
-	close(fd[1]); // close write
-	ssize_t s = 0;
-	while ((size_t)s < sizeof(pid_t)) {
-		s += read(fd[0], ((uint8_t *)&child) + s, sizeof(pid_t) - s);
+	char **envp = spawn_env(wlr_xdg_activation_token_v1_get_name(view->token));
+
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t set;
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+	short flags = POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_SETSID
+	flags |= POSIX_SPAWN_SETSID;
+#endif
+	posix_spawnattr_setflags(&attr, flags);
+	char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+	pid_t pid;
+	int err = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp);
+	posix_spawnattr_destroy(&attr);
+	free_spawn_env(envp);
+	if (err != 0) {
+		wlr_log(WLR_ERROR, "Unable to spawn %s: %s", cmd, strerror(err));
+		wio_new_view_destroy(view);
+		return;
+	}
+
+	view->pid = pid;
+	watch_child(server, pid);
+}
+
+/*
+ * Tops the pool up to -p windows, counting the ones still starting. A pool
+ * window whose process dies isn't replaced until the next claim, so a
+ * broken command doesn't respawn in a loop.
+ */
+void
+wio_fill_pool(struct wio_server *server) {
+	int count = wl_list_length(&server->pool);
+	struct wio_new_view *pending;
+	wl_list_for_each(pending, &server->new_views, link) {
+		if (pending->pooled) {
+			++count;
+		}
+	}
+	struct wlr_box box = {0};
+	for (; count < server->pool_size; ++count) {
+		spawn_view(server, box, true);
 	}
-	close(fd[0]);
-	waitpid(pid, NULL, 0);
-	if (child > 0) {
-		view->pid = child;
-		wl_list_insert(&server->new_views, &view->link);
+}
+
+static void
+new_view(struct wio_server *server) {
+	struct wlr_box box = wio_which_box(server);
+	if (box.width < MINWIDTH || box.height < MINHEIGHT) {
+		return;
+ 	}
+	if (wio_pool_claim(server, box)) {
+		wio_fill_pool(server);
+		return;
 	}
+	spawn_view(server, box, false);
 }
 
 static void
@@ -331,8 +792,7 @@ handle_button_internal(struct wio_server *server, struct wlr_pointer_button_even
 		if (event->state == WL_POINTER_BUTTON_STATE_PRESSED) {
 			// TODO: Open over the last-used menu item
 			server->input_state = INPUT_STATE_MENU;
-			server->menu.x = server->cursor->x;
-			server->menu.y = server->cursor->y;
+			wio_open_menu(server, server->cursor->x, server->cursor->y);
 		}
 		break;
 	case INPUT_STATE_MENU:
@@ -342,7 +802,7 @@ handle_button_internal(struct wio_server *server, struct wlr_pointer_button_even
 		}
 		if (event->state == WL_POINTER_BUTTON_STATE_PRESSED) {
 			server->input_state = INPUT_STATE_NONE;
-			server->menu.x = server->menu.y = -1;
+			wio_close_menu(server);
 		}
 		break;
 	case INPUT_STATE_NEW_START:
@@ -388,6 +848,7 @@ handle_button_internal(struct wio_server *server, struct wlr_pointer_button_even
 		break; // TODO: should this be inside or outside the if?
 		}
 	Done:
+		wio_view_set_fullscreen(server->interactive.view, false, NULL);
 		wio_view_move(server->interactive.view, box.x, box.y);
 		wlr_xdg_toplevel_set_size(server->interactive.view->xdg_toplevel, box.width, box.height);
 
@@ -399,12 +860,15 @@ handle_button_internal(struct wio_server *server, struct wlr_pointer_button_even
 		}
 		view = wio_view_at(server, server->cursor->x, server->cursor->y, &surface, &sx, &sy);
 		if (view) {
-			view_begin_interactive(view, surface, sx, sy, "grabbing", INPUT_STATE_MOVE);
+			// Relative to the window, sx/sy are relative to the surface hit
+			view_begin_interactive(view, surface, server->cursor->x - view->x,
+					server->cursor->y - view->y, "grabbing", INPUT_STATE_MOVE);
 		} else {
 			view_end_interactive(server);
 		}
 		break;
 	case INPUT_STATE_MOVE:
+		wio_view_set_fullscreen(server->interactive.view, false, NULL);
 		wio_view_move(server->interactive.view,
 					  server->cursor->x - server->interactive.sx,
 					  server->cursor->y - server->interactive.sy);
@@ -426,10 +890,8 @@ handle_button_internal(struct wio_server *server, struct wlr_pointer_button_even
 	}
 }
 
-void
-server_cursor_button(struct wl_listener *listener, void *data) {
-	struct wio_server *server = wl_container_of(listener, server, cursor_button);
-	struct wlr_pointer_button_event *event = data;
+static void
+cursor_button_internal(struct wio_server *server, struct wlr_pointer_button_event *event) {
 	double sx, sy;
 	struct wlr_surface *surface = NULL;
 	struct wio_view *view = NULL;
@@ -452,7 +914,8 @@ server_cursor_button(struct wl_listener *listener, void *data) {
 		break;
 	default:
         if (event->button == BTN_RIGHT) {
-			view_begin_interactive(view, surface, sx, sy, "grabbing", INPUT_STATE_MOVE);
+			view_begin_interactive(view, surface, server->cursor->x - view->x,
+					server->cursor->y - view->y, "grabbing", INPUT_STATE_MOVE);
 			break;
 		}
 		corner = corners[view->area];
@@ -461,10 +924,22 @@ server_cursor_button(struct wl_listener *listener, void *data) {
 	}
 }
 
+void
+server_cursor_button(struct wl_listener *listener, void *data) {
+	struct wio_server *server = wl_container_of(listener, server, cursor_button);
+	struct wlr_pointer_button_event *event = data;
+	// The button applies to where the cursor is now
+	flush_cursor_motion(server);
+	cursor_button_internal(server, event);
+	// The selection box may appear, move or go away
+	wio_update_selection(server);
+}
+
 void
 server_cursor_axis(struct wl_listener *listener, void *data) {
 	struct wio_server *server = wl_container_of(listener, server, cursor_axis);
 	struct wlr_pointer_axis_event *event = data;
+	flush_cursor_motion(server);
 	wlr_seat_pointer_notify_axis(server->seat,
 								 event->time_msec,
 							     event->orientation,
@@ -477,6 +952,7 @@ server_cursor_axis(struct wl_listener *listener, void *data) {
 void
 server_cursor_frame(struct wl_listener *listener, void *data) {
 	struct wio_server *server = wl_container_of(listener, server, cursor_frame);
+	flush_cursor_motion(server);
 	wlr_seat_pointer_notify_frame(server->seat);
 }
 
@@ -487,5 +963,42 @@ seat_request_cursor(struct wl_listener *listener, void *data) {
 	struct wlr_seat_client *focused_client = server->seat->pointer_state.focused_client;
 	if (focused_client == event->seat_client && server->input_state == INPUT_STATE_NONE) {
 		wlr_cursor_set_surface(server->cursor, event->surface, event->hotspot_x, event->hotspot_y);
+		server->cursor_image = NULL;
 	}
 }
+
+static void
+pointer_constraint_destroy(struct wl_listener *listener, void *data) {
+	struct wio_pointer_constraint *constraint = wl_container_of(listener, constraint, destroy);
+	struct wio_server *server = constraint->server;
+	if (server->active_constraint == constraint->constraint) {
+		server->active_constraint = NULL;
+	}
+	wl_list_remove(&constraint->set_region.link);
+	wl_list_remove(&constraint->destroy.link);
+	free(constraint);
+}
+
+static void
+pointer_constraint_set_region(struct wl_listener *listener, void *data) {
+	struct wio_pointer_constraint *constraint = wl_container_of(listener, constraint, set_region);
+	// The pointer may have entered or left the region without moving
+	update_pointer_constraint(constraint->server);
+}
+
+void
+server_new_pointer_constraint(struct wl_listener *listener, void *data) {
+	struct wio_server *server = wl_container_of(listener, server, new_pointer_constraint);
+	struct wlr_pointer_constraint_v1 *wlr_constraint = data;
+
+	struct wio_pointer_constraint *constraint = calloc(1, sizeof(struct wio_pointer_constraint));
+	constraint->server = server;
+	constraint->constraint = wlr_constraint;
+	constraint->set_region.notify = pointer_constraint_set_region;
+	wl_signal_add(&wlr_constraint->events.set_region, &constraint->set_region);
+	constraint->destroy.notify = pointer_constraint_destroy;
+	wl_signal_add(&wlr_constraint->events.destroy, &constraint->destroy);
+
+	// The pointer may already be over the surface
+	update_pointer_constraint(server);
+}
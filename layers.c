@@ -2,6 +2,7 @@
 #include <string.h>
 #include <wayland-server.h>
 #include <wlr/types/wlr_layer_shell_v1.h>
+#include <wlr/types/wlr_scene.h>
 #include <wlr/util/box.h>
 
 #include "layers.h"
@@ -72,10 +73,14 @@ static void apply_exclusive(struct wlr_box *usable_area,
 static void arrange_layer(struct wlr_output *output,
 		struct wl_list *list /* struct *wio_layer_surface */,
 		struct wlr_box *usable_area, bool exclusive) {
+	struct wio_output *wio_output = output->data;
 	struct wio_layer_surface *wio_surface;
 	struct wlr_box full_area = { 0 };
 	wlr_output_effective_resolution(output,
 			&full_area.width, &full_area.height);
+	struct wlr_box output_box;
+	wlr_output_layout_get_box(wio_output->server->output_layout,
+			output, &output_box);
 	wl_list_for_each_reverse(wio_surface, list, link) {
 		struct wlr_layer_surface_v1 *layer = wio_surface->layer_surface;
 		struct wlr_layer_surface_v1_state *state = &layer->current;
@@ -143,6 +148,8 @@ static void arrange_layer(struct wlr_output *output,
 
 		// Apply
 		wio_surface->geo = box;
+		wlr_scene_node_set_position(&wio_surface->scene->tree->node,
+				output_box.x + box.x, output_box.y + box.y);
 		apply_exclusive(usable_area, state->anchor, state->exclusive_zone,
 				state->margin.top, state->margin.right,
 				state->margin.bottom, state->margin.left);
@@ -229,20 +236,15 @@ static void handle_destroy(struct wl_listener *listener, void *data) {
 	struct wio_layer_surface *layer = wl_container_of(listener, layer, destroy);
 	wl_list_remove(&layer->link);
 	wl_list_remove(&layer->destroy.link);
-	wl_list_remove(&layer->map.link);
 	wl_list_remove(&layer->surface_commit.link);
 	if (layer->layer_surface->output) {
+		struct wio_output *output = layer->layer_surface->output->data;
 		wl_list_remove(&layer->output_destroy.link);
-		arrange_layers((struct wio_output *) layer->layer_surface->output->data);
+		arrange_layers(output);
 	}
 	free(layer);
 }
 
-static void handle_map(struct wl_listener *listener, void *data) {
-	struct wlr_layer_surface_v1 *layer_surface = data;
-	wlr_surface_send_enter(layer_surface->surface, layer_surface->output);
-}
-
 void server_new_layer_surface(struct wl_listener *listener, void *data) {
 	struct wio_server *server = wl_container_of(
 			listener, server, new_layer_surface);
@@ -262,6 +264,8 @@ void server_new_layer_surface(struct wl_listener *listener, void *data) {
 	wio_surface->layer_surface = layer_surface;
 	layer_surface->data = wio_surface;
 	wio_surface->server = server;
+	wio_surface->scene = wlr_scene_layer_surface_v1_create(
+			server->layer_trees[layer_surface->pending.layer], layer_surface);
 
 	wio_surface->surface_commit.notify = handle_surface_commit;
 	wl_signal_add(&layer_surface->surface->events.commit,
@@ -271,8 +275,6 @@ void server_new_layer_surface(struct wl_listener *listener, void *data) {
 		&wio_surface->output_destroy);
 	wio_surface->destroy.notify = handle_destroy;
 	wl_signal_add(&layer_surface->events.destroy, &wio_surface->destroy);
-	wio_surface->map.notify = handle_map;
-	wl_signal_add(&layer_surface->surface->events.map, &wio_surface->map);
 	// TODO: popups
 
 	// TODO: Listen for subsurfaces
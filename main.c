@@ -4,82 +4,199 @@
 #include <cairo/cairo.h>
 #include <drm_fourcc.h>
 #include <getopt.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <wayland-server.h>
 #include <wlr/backend.h>
+#include <wlr/interfaces/wlr_buffer.h>
 #include <wlr/render/allocator.h>
 #include <wlr/render/wlr_renderer.h>
-#include <wlr/render/wlr_texture.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_data_control_v1.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_export_dmabuf_v1.h>
+#include <wlr/types/wlr_fractional_scale_v1.h>
 #include <wlr/types/wlr_gamma_control_v1.h>
 #include <wlr/types/wlr_layer_shell_v1.h>
+#include <wlr/types/wlr_presentation_time.h>
+#include <wlr/types/wlr_pointer_constraints_v1.h>
 #include <wlr/types/wlr_primary_selection_v1.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
+#include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_screencopy_v1.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_subcompositor.h>
+#include <wlr/types/wlr_tearing_control_v1.h>
+#include <wlr/types/wlr_viewporter.h>
+#include <wlr/types/wlr_xdg_activation_v1.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/types/wlr_xdg_output_v1.h>
 #include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/util/log.h>
 
+#include "colors.h"
 #include "layers.h"
 #include "server.h"
 #include "view.h"
 
 #define XDG_SHELL_VERSION 2
 #define LAYER_SHELL_V1_VERSION 4
+#define TEARING_CONTROL_V1_VERSION 1
+#define FRACTIONAL_SCALE_V1_VERSION 1
 
-static void gen_menu_textures(struct wio_server *server) {
-	struct wlr_renderer *renderer = server->renderer;
+struct wio_cairo_buffer {
+	struct wlr_buffer base;
+	cairo_surface_t *surface;
+};
+
+static void cairo_buffer_destroy(struct wlr_buffer *wlr_buffer) {
+	struct wio_cairo_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	cairo_surface_destroy(buffer->surface);
+	free(buffer);
+}
+
+static bool cairo_buffer_begin_data_ptr_access(struct wlr_buffer *wlr_buffer,
+		uint32_t flags, void **data, uint32_t *format, size_t *stride) {
+	struct wio_cairo_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	if (flags & WLR_BUFFER_DATA_PTR_ACCESS_WRITE) {
+		return false;
+	}
+	*data = cairo_image_surface_get_data(buffer->surface);
+	// Opaque, so the scene draws it without blending
+	*format = DRM_FORMAT_XRGB8888;
+	*stride = cairo_image_surface_get_stride(buffer->surface);
+	return true;
+}
+
+static void cairo_buffer_end_data_ptr_access(struct wlr_buffer *wlr_buffer) {
+	// This space is intentionally left blank
+}
+
+static const struct wlr_buffer_impl cairo_buffer_impl = {
+	.destroy = cairo_buffer_destroy,
+	.begin_data_ptr_access = cairo_buffer_begin_data_ptr_access,
+	.end_data_ptr_access = cairo_buffer_end_data_ptr_access,
+};
+
+static void set_menu_font(cairo_t *cairo) {
 	// numbers pulled from ass
-	cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 128, 128);
-	cairo_t *cairo = cairo_create(surf);
 	cairo_select_font_face(cairo, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
 	cairo_set_font_size(cairo, 14);
-	cairo_set_source_rgb(cairo, 0, 0, 0);
+}
 
-	char *text[] = {"New", "Resize", "Move", "Delete", "Hide"};
-	for (size_t i = 0; i < countof(text); ++i) {
-		cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-		cairo_paint(cairo);
-		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-		cairo_text_extents_t extents;
-		cairo_text_extents(cairo, text[i], &extents);
-		cairo_move_to(cairo, 0, extents.height);
-		cairo_show_text(cairo, text[i]);
-		cairo_surface_flush(surf);
-		unsigned char *data = cairo_image_surface_get_data(surf);
-		server->menu.inactive_textures[i] = wlr_texture_from_pixels(renderer,
-				DRM_FORMAT_ARGB8888,
-				cairo_image_surface_get_stride(surf),
-				extents.width + 2, extents.height + 2, data);
+static const char *menu_labels[] = {"New", "Resize", "Move", "Delete", "Hide"};
+
+/*
+ * Draws every label, one under the other, over the colour of the menu row
+ * it sits on. That keeps the buffer fully opaque and skips blending it on
+ * top of that row.
+ */
+static struct wlr_buffer *gen_atlas_buffer(struct wio_server *server,
+		struct wio_menu_atlas *atlas, double color, const float bg[static 4]) {
+	int width = 0, height = 0;
+	for (size_t i = 0; i < countof(menu_labels); ++i) {
+		width = MAX(width, (int)atlas->sources[i].width);
+		height += atlas->sources[i].height;
 	}
 
-	cairo_set_source_rgb(cairo, 1, 1, 1);
-	for (size_t i = 0; i < countof(text); ++i) {
-		cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-		cairo_paint(cairo);
-		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-		cairo_text_extents_t extents;
-		cairo_text_extents(cairo, text[i], &extents);
-		cairo_move_to(cairo, 0, extents.height);
-		cairo_show_text(cairo, text[i]);
-		cairo_surface_flush(surf);
-		unsigned char *data = cairo_image_surface_get_data(surf);
-		server->menu.active_textures[i] = wlr_texture_from_pixels(renderer,
-				DRM_FORMAT_ARGB8888,
-				cairo_image_surface_get_stride(surf),
-				extents.width + 2, extents.height + 2, data);
+	cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	cairo_t *cairo = cairo_create(surf);
+	cairo_set_source_rgb(cairo, bg[0], bg[1], bg[2]);
+	cairo_paint(cairo);
+	cairo_set_source_rgb(cairo, color, color, color);
+	for (size_t i = 0; i < countof(menu_labels); ++i) {
+		cairo_save(cairo);
+		cairo_translate(cairo, 0, atlas->sources[i].y);
+		cairo_scale(cairo, atlas->scale, atlas->scale);
+		set_menu_font(cairo);
+		cairo_move_to(cairo, 0, server->menu.label_height[i] - 2);
+		cairo_show_text(cairo, menu_labels[i]);
+		cairo_restore(cairo);
+	}
+	cairo_surface_flush(surf);
+	cairo_destroy(cairo);
+
+	struct wio_cairo_buffer *buffer = calloc(1, sizeof(struct wio_cairo_buffer));
+	wlr_buffer_init(&buffer->base, &cairo_buffer_impl, width, height);
+	buffer->surface = surf;
+	return &buffer->base;
+}
+
+struct wio_menu_atlas *wio_menu_atlas_get(struct wio_server *server, float scale) {
+	struct wio_menu_atlas *atlas;
+	wl_list_for_each(atlas, &server->menu.atlases, link) {
+		if (atlas->scale == scale) {
+			return atlas;
+		}
 	}
 
+	atlas = calloc(1, sizeof(struct wio_menu_atlas));
+	atlas->scale = scale;
+	// Rows start on whole pixels, so sampling one never picks up another
+	int y = 0;
+	for (size_t i = 0; i < countof(menu_labels); ++i) {
+		atlas->sources[i] = (struct wlr_fbox){
+			.x = 0, .y = y,
+			.width = ceil(server->menu.label_width[i] * scale),
+			.height = ceil(server->menu.label_height[i] * scale),
+		};
+		y += atlas->sources[i].height;
+	}
+	atlas->inactive = gen_atlas_buffer(server, atlas, 0, menu_unselected);
+	atlas->active = gen_atlas_buffer(server, atlas, 1, menu_selected);
+	wl_list_insert(&server->menu.atlases, &atlas->link);
+	return atlas;
+}
+
+static void gen_menu(struct wio_server *server) {
+	struct wlr_scene_tree *tree = server->menu.tree;
+	server->menu.background = wlr_scene_rect_create(tree, 0, 0, menu_unselected);
+	for (size_t i = 0; i < countof(server->menu.borders); ++i) {
+		server->menu.borders[i] = wlr_scene_rect_create(tree, 0, 0, menu_border);
+	}
+	server->menu.selection = wlr_scene_rect_create(tree, 0, 0, menu_selected);
+
+	// Only measured here, the atlases are drawn when an output needs one
+	cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
+	cairo_t *cairo = cairo_create(surf);
+	set_menu_font(cairo);
+	for (size_t i = 0; i < countof(menu_labels); ++i) {
+		cairo_text_extents_t extents;
+		cairo_text_extents(cairo, menu_labels[i], &extents);
+		server->menu.label_width[i] = extents.width + 2;
+		server->menu.label_height[i] = extents.height + 2;
+		server->menu.items[i] = wlr_scene_buffer_create(tree, NULL);
+	}
 	cairo_destroy(cairo);
 	cairo_surface_destroy(surf);
+	wl_list_init(&server->menu.atlases);
+	wlr_scene_node_set_enabled(&tree->node, false);
+}
+
+static void create_scene(struct wio_server *server) {
+	server->scene = wlr_scene_create();
+	server->scene_layout = wlr_scene_attach_output_layout(
+			server->scene, server->output_layout);
+	struct wlr_scene_tree *root = &server->scene->tree;
+
+	server->background_tree = wlr_scene_tree_create(root);
+	server->layer_trees[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND] = wlr_scene_tree_create(root);
+	server->layer_trees[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM] = wlr_scene_tree_create(root);
+	server->view_tree = wlr_scene_tree_create(root);
+
+	server->layer_trees[ZWLR_LAYER_SHELL_V1_LAYER_TOP] = wlr_scene_tree_create(root);
+	// Above panels, so a fullscreen view can be scanned out directly
+	server->fullscreen_tree = wlr_scene_tree_create(root);
+	// Rubber bands stay visible over fullscreen views
+	server->selection.tree = wlr_scene_tree_create(root);
+	server->selection.fill = wlr_scene_rect_create(server->selection.tree, 0, 0, surface);
+	wio_create_borders(server->selection.tree, server->selection.borders, selection_box);
+	wlr_scene_node_set_enabled(&server->selection.tree->node, false);
+	server->menu.tree = wlr_scene_tree_create(root);
+	server->layer_trees[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY] = wlr_scene_tree_create(root);
 }
 
 static enum wl_output_transform str_to_transform(const char *str) {
@@ -105,9 +222,22 @@ static enum wl_output_transform str_to_transform(const char *str) {
 	}
 }
 
+static enum wio_tearing_policy str_to_tearing(const char *str) {
+	if (strcmp(str, "never") == 0 || strcmp(str, "0") == 0)
+		return TEARING_NEVER;
+	else if (strcmp(str, "focused") == 0)
+		return TEARING_FOCUSED;
+	else if (strcmp(str, "fullscreen") == 0)
+		return TEARING_FULLSCREEN;
+	else {
+		fprintf(stderr, "Invalid tearing policy %s\n", str);
+		exit(1);
+	}
+}
+
 void parse_args(int argc, char *argv[], struct wio_server *server) {
 	int c;
-	while ((c = getopt(argc, argv, "c:t:o:h")) != -1) {
+	while ((c = getopt(argc, argv, "c:t:do:p:h")) != -1) {
 		switch (c) {
 		case 'c':
 			server->cage = optarg;
@@ -115,8 +245,14 @@ void parse_args(int argc, char *argv[], struct wio_server *server) {
 		case 't':
 			server->term = optarg;
 			break;
+		case 'd':
+			server->direct = true;
+			break;
+		case 'p':
+			server->pool_size = atoi(optarg);
+			break;
 		case 'o':;
-			// name:x:y:width:height:scale:transform
+			// name:x:y:width:height:scale:transform:max_render_time:refresh:vrr:tearing
 			struct wio_output_config *config = calloc(1, sizeof(struct wio_output_config));
 			wl_list_insert(&server->output_configs, &config->link);
 			const char *tok = strtok(optarg, ":");
@@ -138,14 +274,33 @@ void parse_args(int argc, char *argv[], struct wio_server *server) {
 			tok = strtok(NULL, ":");
 			if (!tok)
 				break;
-			config->scale = atoi(tok);
+			config->scale = strtof(tok, NULL);
 			tok = strtok(NULL, ":");
 			if (!tok)
 				break;
 			config->transform = str_to_transform(tok);
+			tok = strtok(NULL, ":");
+			if (!tok)
+				break;
+			if (strcmp(tok, "auto") == 0)
+				config->max_render_time = -1;
+			else
+				config->max_render_time = atoi(tok);
+			tok = strtok(NULL, ":");
+			if (!tok)
+				break;
+			config->refresh = strtod(tok, NULL) * 1000;
+			tok = strtok(NULL, ":");
+			if (!tok)
+				break;
+			config->adaptive_sync = strcmp(tok, "vrr") == 0 || atoi(tok) > 0;
+			tok = strtok(NULL, ":");
+			if (!tok)
+				break;
+			config->tearing = str_to_tearing(tok);
 			break;
 		case 'h':
-			printf("Usage: %s [-t <term>] [-c <cage>] [-o <output config>...]\n", argv[0]);
+			printf("Usage: %s [-t <term>] [-c <cage>] [-d] [-p <pool size>] [-o <output config>...]\n", argv[0]);
 			exit(0);
 		default:
 			fprintf(stderr, "Unrecognized option %c\n", c);
@@ -165,6 +320,8 @@ int main(int argc, char *argv[]) {
 	parse_args(argc, argv, &server);
 
 	server.wl_display = wl_display_create();
+	// Compiles the keymap while the backend and globals are set up
+	wio_keymap_prewarm(&server);
 	server.backend = wlr_backend_autocreate(wl_display_get_event_loop(server.wl_display),
 	                                        &server.session);
 	if (!server.backend) {
@@ -178,6 +335,11 @@ int main(int argc, char *argv[]) {
 	wlr_compositor_create(server.wl_display, compositor_version, server.renderer);
 	wlr_subcompositor_create(server.wl_display);
 	wlr_data_device_manager_create(server.wl_display);
+	// wlr_scene tells each surface the scale of the outputs it is on, so
+	// clients can draw at that exact size and have it mapped 1:1
+	wlr_fractional_scale_manager_v1_create(server.wl_display,
+			FRACTIONAL_SCALE_V1_VERSION);
+	wlr_viewporter_create(server.wl_display);
 
 	wlr_export_dmabuf_manager_v1_create(server.wl_display);
 	wlr_screencopy_manager_v1_create(server.wl_display);
@@ -185,6 +347,10 @@ int main(int argc, char *argv[]) {
 	wlr_primary_selection_v1_device_manager_create(server.wl_display);
 
 	wlr_gamma_control_manager_v1_create(server.wl_display);
+	// wlr_scene sends the feedback once a surface is presented
+	wlr_presentation_create(server.wl_display, server.backend);
+	server.tearing_control = wlr_tearing_control_manager_v1_create(
+			server.wl_display, TEARING_CONTROL_V1_VERSION);
 	// wlr_gtk_primary_selection_device_manager_create(server.wl_display);
 
 	wl_list_init(&server.outputs);
@@ -192,7 +358,10 @@ int main(int argc, char *argv[]) {
 	wl_signal_add(&server.backend->events.new_output, &server.new_output);
 
 	server.output_layout = wlr_output_layout_create(server.wl_display);
+	server.output_layout_change.notify = server_output_layout_change;
+	wl_signal_add(&server.output_layout->events.change, &server.output_layout_change);
 	wlr_xdg_output_manager_v1_create(server.wl_display, server.output_layout);
+	create_scene(&server);
 
 	server.cursor = wlr_cursor_create();
 	wlr_cursor_attach_output_layout(server.cursor, server.output_layout);
@@ -223,11 +392,18 @@ int main(int argc, char *argv[]) {
 	server.seat = wlr_seat_create(server.wl_display, "seat0");
 	server.request_cursor.notify = seat_request_cursor;
 	wl_signal_add(&server.seat->events.request_set_cursor, &server.request_cursor);
+
+	server.relative_pointer_manager = wlr_relative_pointer_manager_v1_create(server.wl_display);
+	server.pointer_constraints = wlr_pointer_constraints_v1_create(server.wl_display);
+	server.new_pointer_constraint.notify = server_new_pointer_constraint;
+	wl_signal_add(&server.pointer_constraints->events.new_constraint, &server.new_pointer_constraint);
 	wl_list_init(&server.keyboards);
+	wio_create_keyboard_group(&server);
 	wl_list_init(&server.pointers);
 
 	wl_list_init(&server.views);
 	wl_list_init(&server.new_views);
+	wl_list_init(&server.pool);
 	server.xdg_shell = wlr_xdg_shell_create(server.wl_display, XDG_SHELL_VERSION);
 	server.xdg_shell_new_toplevel.notify = server_xdg_shell_new_toplevel;
 	wl_signal_add(&server.xdg_shell->events.new_toplevel, &server.xdg_shell_new_toplevel);
@@ -236,12 +412,17 @@ int main(int argc, char *argv[]) {
 	server.new_toplevel_decoration.notify = server_new_toplevel_decoration;
 	wl_signal_add(&server.xdg_decoration_manager->events.new_toplevel_decoration, &server.new_toplevel_decoration);
 
+	// New hands a token to each window it spawns to find it again
+	server.xdg_activation = wlr_xdg_activation_v1_create(server.wl_display);
+	server.xdg_activation_request.notify = server_xdg_activation_request;
+	wl_signal_add(&server.xdg_activation->events.request_activate, &server.xdg_activation_request);
+
 	server.layer_shell = wlr_layer_shell_v1_create(server.wl_display, LAYER_SHELL_V1_VERSION);
 	server.new_layer_surface.notify = server_new_layer_surface;
 	wl_signal_add(&server.layer_shell->events.new_surface, &server.new_layer_surface);
 
 	server.menu.x = server.menu.y = -1;
-	gen_menu_textures(&server);
+	gen_menu(&server);
 
 	const char *socket = wl_display_add_socket_auto(server.wl_display);
 	if (!socket) {
@@ -257,9 +438,11 @@ int main(int argc, char *argv[]) {
 
 	setenv("WAYLAND_DISPLAY", socket, true);
 	wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s", socket);
+	wio_fill_pool(&server);
 	wl_display_run(server.wl_display);
 
 	wl_display_destroy_clients(server.wl_display);
+	wlr_scene_node_destroy(&server.scene->tree.node);
 	wlr_xcursor_manager_destroy(server.cursor_mgr);
 	wlr_cursor_destroy(server.cursor);
 	wlr_allocator_destroy(server.allocator);
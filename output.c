@@ -1,381 +1,390 @@
 #define _POSIX_C_SOURCE 200112L
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <time.h>
 #include <wayland-server.h>
-#include <wlr/render/allocator.h>
-#include <wlr/render/pass.h>
-#include <wlr/render/wlr_renderer.h>
-#include <wlr/types/wlr_matrix.h>
+#include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/types/wlr_tearing_control_v1.h>
 #include <wlr/util/box.h>
-#include <wlr/util/transform.h>
+#include <wlr/util/log.h>
 
 #include "colors.h"
 #include "layers.h"
 #include "server.h"
 #include "view.h"
 
-struct render_data {
-	struct wlr_output *output;
-	struct wlr_render_pass *render_pass;
-	struct wio_view *view;
-	struct timespec *when;
-};
-
-static int scale_length(int length, int offset, float scale) {
-	return round((offset + length) * scale) - round(offset * scale);
-}
-
-void scale_box(struct wlr_box *box, float scale) {
-	box->width = scale_length(box->width, box->x, scale);
-	box->height = scale_length(box->height, box->y, scale);
-	box->x = round(box->x * scale);
-	box->y = round(box->y * scale);
+void wio_create_borders(struct wlr_scene_tree *parent,
+		struct wlr_scene_rect *borders[static 4], const float color[static 4]) {
+	for (size_t i = 0; i < 4; ++i) {
+		borders[i] = wlr_scene_rect_create(parent, 0, 0, color);
+	}
 }
 
-static void render_surface(struct wlr_surface *surface,
-		int sx, int sy, void *data) {
-	struct render_data *rdata = data;
-	struct wio_view *view = rdata->view;
-	struct wlr_output *output = rdata->output;
-	struct wlr_texture *texture = wlr_surface_get_texture(surface);
-	if (texture == NULL) {
-		return;
+void wio_set_borders(struct wlr_scene_rect *borders[static 4],
+		int width, int height, const float color[static 4]) {
+	// Top
+	wlr_scene_node_set_position(&borders[0]->node,
+			-window_border, -window_border);
+	wlr_scene_rect_set_size(borders[0],
+			width + window_border * 2, window_border);
+	// Right
+	wlr_scene_node_set_position(&borders[1]->node, width, -window_border);
+	wlr_scene_rect_set_size(borders[1],
+			window_border, height + window_border * 2);
+	// Bottom
+	wlr_scene_node_set_position(&borders[2]->node, -window_border, height);
+	wlr_scene_rect_set_size(borders[2],
+			width + window_border * 2, window_border);
+	// Left
+	wlr_scene_node_set_position(&borders[3]->node,
+			-window_border, -window_border);
+	wlr_scene_rect_set_size(borders[3],
+			window_border, height + window_border * 2);
+	for (size_t i = 0; i < 4; ++i) {
+		wlr_scene_rect_set_color(borders[i], color);
 	}
-	double ox = 0, oy = 0;
-	wlr_output_layout_output_coords(
-			view->server->output_layout, output, &ox, &oy);
-	ox += view->x + sx, oy += view->y + sy;
-	struct wlr_box box = {
-		.x = ox,
-		.y = oy,
-		.width = surface->current.width,
-		.height = surface->current.height,
-	};
-	scale_box(&box, output->scale);
-	struct wlr_render_texture_options options = {
-		.texture = texture,
-		.dst_box = box,
-		.transform = wlr_output_transform_invert(surface->current.transform),
-	};
-	wlr_render_pass_add_texture(rdata->render_pass, &options);
-	wlr_surface_send_frame_done(surface, rdata->when);
 }
 
-static void render_menu(struct wio_output *output) {
-	struct wio_server *server = output->server;
-	struct wlr_render_pass *render_pass = server->render_pass;
+void wio_open_menu(struct wio_server *server, int x, int y) {
+	struct wlr_scene_tree *tree = server->menu.tree;
+	server->menu.x = x;
+	server->menu.y = y;
 
-	size_t ntextures = countof(server->menu.inactive_textures);
-	int scale = output->wlr_output->scale;
-	int border = 3 * scale, margin = 4 * scale;
+	size_t nitems = countof(server->menu.items);
+	int border = 3, margin = 4;
 	int text_height = 0, text_width = 0;
-	for (size_t i = 0; i < ntextures; ++i) {
-		int width, height;
-		// Assumes inactive/active textures are the same size
-		// (they probably are)
-		width = server->menu.inactive_textures[i]->width;
-		height = server->menu.inactive_textures[i]->height;
-		width /= scale, height /= scale;
-		text_height += height + margin;
-		if (width >= text_width) {
-			text_width = width;
+	for (size_t i = 0; i < nitems; ++i) {
+		text_height += server->menu.label_height[i] + margin;
+		if (server->menu.label_width[i] >= text_width) {
+			text_width = server->menu.label_width[i];
 		}
 	}
 	text_width += border * 2 + margin;
 	text_height += border * 2 - margin;
 
-	double ox = server->menu.x, oy = server->menu.y;
-	wlr_output_layout_output_coords(
-			server->output_layout, output->wlr_output, &ox, &oy);
-
-	struct wlr_box bg_box = { 0 };
-	struct wlr_render_rect_options options = { 0 };
+	wlr_scene_node_set_position(&tree->node, x, y);
 	// Background
-	bg_box.x = ox;
-	bg_box.y = oy;
-	bg_box.width = text_width;
-	bg_box.height = text_height;
-	scale_box(&bg_box, scale);
-	options.box = bg_box;
-	options.color = menu_unselected;
-	wlr_render_pass_add_rect(render_pass, &options);
+	wlr_scene_rect_set_size(server->menu.background, text_width, text_height);
 	// Top
-	bg_box.x = ox;
-	bg_box.y = oy;
-	bg_box.width = text_width;
-	bg_box.height = border;
-	scale_box(&bg_box, scale);
-	options.box = bg_box;
-	options.color = menu_border;
-	wlr_render_pass_add_rect(render_pass, &options);
+	wlr_scene_node_set_position(&server->menu.borders[0]->node, 0, 0);
+	wlr_scene_rect_set_size(server->menu.borders[0], text_width, border);
 	// Bottom
-	bg_box.x = ox;
-	bg_box.y = oy + text_height;
-	bg_box.width = text_width + border;
-	bg_box.height = border;
-	scale_box(&bg_box, scale);
-	options.box = bg_box;
-	options.color = menu_border;
-	wlr_render_pass_add_rect(render_pass, &options);
+	wlr_scene_node_set_position(&server->menu.borders[1]->node, 0, text_height);
+	wlr_scene_rect_set_size(server->menu.borders[1], text_width + border, border);
 	// Left
-	bg_box.x = ox;
-	bg_box.y = oy;
-	bg_box.width = border;
-	bg_box.height = text_height;
-	scale_box(&bg_box, scale);
-	options.box = bg_box;
-	options.color = menu_border;
-	wlr_render_pass_add_rect(render_pass, &options);
+	wlr_scene_node_set_position(&server->menu.borders[2]->node, 0, 0);
+	wlr_scene_rect_set_size(server->menu.borders[2], border, text_height);
 	// Right
-	bg_box.x = ox + text_width;
-	bg_box.y = oy;
-	bg_box.width = border;
-	bg_box.height = text_height;
-	scale_box(&bg_box, scale);
-	options.box = bg_box;
-	options.color = menu_border;
-	wlr_render_pass_add_rect(render_pass, &options);
-
-	double cur_x = server->cursor->x, cur_y = server->cursor->y;
-	wlr_output_layout_output_coords(server->output_layout,
-			output->wlr_output, &cur_x, &cur_y);
-	server->menu.selected = -1;
-	ox += margin;
-	oy += margin;
-	for (size_t i = 0; i < ntextures; ++i) {
-		int width, height;
-		struct wlr_texture *texture = server->menu.inactive_textures[i];
-		width = texture->width;
-		height = texture->height;
-		width /= scale, height /= scale;
-		struct wlr_box box = { 0 };
-		box.x = ox - scale /* fudge */;
-		box.y = oy - scale /* fudge */;
-		box.width = text_width - border;
-		box.height = height + margin;
-		if (wlr_box_contains_point(&box, cur_x, cur_y)) {
-			server->menu.selected = i;
-			texture = server->menu.active_textures[i];
-			scale_box(&box, scale);
-			struct wlr_render_rect_options options = {
-				.box = box,
-			    .color = menu_selected
-			};
-			wlr_render_pass_add_rect(render_pass, &options);
-		} else {
-			width = texture->width;
-            height = texture->height;
-			width /= scale, height /= scale;
-		}
-		box.x = (ox + (text_width / 2 - width / 2));
-		box.y = oy;
-		box.width = width;
-		box.height = height;
-		scale_box(&box, scale);
-		struct wlr_render_texture_options options = {
-			.texture = texture,
-			.dst_box = box,
-			.transform = WL_OUTPUT_TRANSFORM_NORMAL,
+	wlr_scene_node_set_position(&server->menu.borders[3]->node, text_width, 0);
+	wlr_scene_rect_set_size(server->menu.borders[3], border, text_height);
+
+	// Labels are drawn at the scale of the output the menu opens on
+	struct wlr_output *wlr_output = wlr_output_layout_output_at(
+			server->output_layout, x, y);
+	struct wio_menu_atlas *atlas = wio_menu_atlas_get(server,
+			wlr_output ? wlr_output->scale : 1);
+	server->menu.atlas = atlas;
+
+	int row_y = margin;
+	for (size_t i = 0; i < nitems; ++i) {
+		int width = server->menu.label_width[i];
+		int height = server->menu.label_height[i];
+		server->menu.rows[i] = (struct wlr_box){
+			.x = margin - 1 /* fudge */,
+			.y = row_y - 1 /* fudge */,
+			.width = text_width - border,
+			.height = height + margin,
 		};
-		wlr_render_pass_add_texture(render_pass, &options);
-		oy += height + margin;
+		struct wlr_scene_buffer *item = server->menu.items[i];
+		wlr_scene_buffer_set_buffer(item, atlas->inactive);
+		wlr_scene_buffer_set_source_box(item, &atlas->sources[i]);
+		wlr_scene_buffer_set_dest_size(item, width, height);
+		wlr_scene_node_set_position(&item->node,
+				margin + (text_width / 2 - width / 2), row_y);
+		row_y += height + margin;
 	}
 
 	server->menu.width = text_width;
 	server->menu.height = text_height;
+	server->menu.selected = -1;
+	wlr_scene_node_set_enabled(&server->menu.selection->node, false);
+	wio_menu_select(server);
+	wlr_scene_node_set_enabled(&tree->node, true);
 }
 
-static void render_view_border(struct wlr_render_pass *render_pass,
-							   struct wio_output *output, struct wio_view *view,
-							   struct wlr_box box, int selection) {
-	struct wlr_render_color color;
-	if (selection)
-		color = selection_box;
-	else if (!view || view->xdg_toplevel->current.activated)
-		color = active_border;
-	else
-		color = inactive_border;
+void wio_close_menu(struct wio_server *server) {
+	server->menu.x = server->menu.y = -1;
+	wlr_scene_node_set_enabled(&server->menu.tree->node, false);
+}
 
-	struct wlr_output *wlr_output = output->wlr_output;
-	int scale = wlr_output->scale;
-	double ox = 0, oy = 0;
-	wlr_output_layout_output_coords(output->server->output_layout, wlr_output, &ox, &oy);
-	struct wlr_box borders = { 0 };
-	struct wlr_render_rect_options options = { 0 };
+/*
+ * Highlights the row under the cursor. Nothing changes unless the cursor
+ * crossed into another row, and then only the two rows are redrawn.
+ */
+void wio_menu_select(struct wio_server *server) {
+	double cur_x = server->cursor->x - server->menu.x;
+	double cur_y = server->cursor->y - server->menu.y;
+	int selected = -1;
+	for (size_t i = 0; i < countof(server->menu.rows); ++i) {
+		if (wlr_box_contains_point(&server->menu.rows[i], cur_x, cur_y)) {
+			selected = i;
+			break;
+		}
+	}
+	if (selected == server->menu.selected) {
+		return;
+	}
 
-	// Top
-	borders.x = ox + (box.x - window_border);
-	borders.y = oy + (box.y - window_border);
-	borders.width = (box.width + window_border * 2) ;
-	borders.height = window_border;
-	scale_box(&borders, scale);
-	options.box = borders;
-	options.color = color;
-	wlr_render_pass_add_rect(render_pass, &options);
+	struct wio_menu_atlas *atlas = server->menu.atlas;
+	if (server->menu.selected != -1) {
+		wlr_scene_buffer_set_buffer(
+				server->menu.items[server->menu.selected], atlas->inactive);
+	}
+	server->menu.selected = selected;
+	if (selected == -1) {
+		wlr_scene_node_set_enabled(&server->menu.selection->node, false);
+		return;
+	}
+	struct wlr_box *row = &server->menu.rows[selected];
+	wlr_scene_buffer_set_buffer(server->menu.items[selected], atlas->active);
+	wlr_scene_node_set_position(&server->menu.selection->node, row->x, row->y);
+	wlr_scene_rect_set_size(server->menu.selection, row->width, row->height);
+	wlr_scene_node_set_enabled(&server->menu.selection->node, true);
+}
 
-	// Right
-	borders.x = ox + (box.x + box.width);
-	borders.y = oy + (box.y - window_border);
-	borders.width = window_border;
-	borders.height = (box.height + window_border * 2);
-	scale_box(&borders, scale);
-	options.box = borders;
-	options.color = color;
-	wlr_render_pass_add_rect(render_pass, &options);
+static bool interactive_box(struct wio_server *server, struct wlr_box *box) {
+	struct wio_view *view = server->interactive.view;
+	switch (server->input_state) {
+	case INPUT_STATE_BORDER_DRAG:
+		*box = wio_which_box(server);
+		*box = wio_canon_box(server, *box);
+		return true;
+	case INPUT_STATE_MOVE:
+		box->x = server->cursor->x - server->interactive.sx;
+		box->y = server->cursor->y - server->interactive.sy;
+		box->width = view->xdg_toplevel->current.width;
+		box->height = view->xdg_toplevel->current.height;
+		return true;
+	case INPUT_STATE_NEW_END:
+	case INPUT_STATE_RESIZE_END:
+		*box = wio_which_box(server);
+		return true;
+	default:
+		return false;
+	}
+}
 
-	// Bottom
-	borders.x = ox + (box.x - window_border);
-	borders.y = oy + (box.y + box.height);
-	borders.width = (box.width + window_border * 2);
-	borders.height = window_border;
-	scale_box(&borders, scale);
-	options.box = borders;
-	options.color = color;
-	wlr_render_pass_add_rect(render_pass, &options);
+void wio_update_selection(struct wio_server *server) {
+	struct wlr_scene_tree *tree = server->selection.tree;
+	struct wlr_box box;
+	if (!interactive_box(server, &box)) {
+		wlr_scene_node_set_enabled(&tree->node, false);
+		return;
+	}
+	wlr_scene_node_set_position(&tree->node, box.x, box.y);
+	bool fill = (server->input_state == INPUT_STATE_NEW_END
+			|| server->input_state == INPUT_STATE_RESIZE_END)
+			&& box.width > 0 && box.height > 0;
+	if (fill) {
+		wlr_scene_rect_set_size(server->selection.fill, box.width, box.height);
+	}
+	wlr_scene_node_set_enabled(&server->selection.fill->node, fill);
+	wio_set_borders(server->selection.borders,
+			box.width, box.height, selection_box);
+	wlr_scene_node_set_enabled(&tree->node, true);
+}
 
-	// Left
-	borders.x = ox + (box.x - window_border);
-	borders.y = oy + (box.y - window_border);
-	borders.width = window_border;
-	borders.height = (box.height + window_border * 2);
-	scale_box(&borders, scale);
-	options.box = borders;
-	options.color = color;
-	wlr_render_pass_add_rect(render_pass, &options);
+static const unsigned int stats_frames = 600;
+
+static int64_t timespec_to_nsec(const struct timespec *ts) {
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
 }
 
-static void render_layer_surface(struct wlr_surface *surface,
-								 int sx, int sy, void *data) {
-	struct wio_layer_surface *layer_surface = data;
-	struct wlr_texture *texture = wlr_surface_get_texture(surface);
-	if (texture == NULL)
+// Headroom on top of the learned render time, for the GPU and page flip
+static const int64_t render_slack_ns = 2000000;
+
+static bool output_allows_tearing(struct wio_output *output) {
+	struct wio_server *server = output->server;
+	struct wlr_surface *surface = server->seat->keyboard_state.focused_surface;
+	if (output->tearing == TEARING_NEVER || !surface) {
+		return false;
+	}
+	if (wlr_tearing_control_manager_v1_surface_hint_from_surface(
+			server->tearing_control, surface)
+			!= WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC) {
+		return false;
+	}
+
+	struct wio_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		if (view->xdg_toplevel->base->surface != surface) {
+			continue;
+		}
+		if (!(view->outputs & (UINT64_C(1) << output->scene_output->index))) {
+			return false;
+		}
+		// A fullscreen view is likely to be scanned out directly
+		return output->tearing == TEARING_FOCUSED || view->fullscreen;
+	}
+	return false;
+}
+
+/*
+ * Same as wlr_scene_output_commit, except that the page flip is allowed to
+ * tear when the output's policy and the focused view agree.
+ */
+static void output_commit(struct wio_output *output) {
+	struct wlr_scene_output *scene_output = output->scene_output;
+	if (!wlr_scene_output_needs_frame(scene_output)) {
 		return;
+	}
+
+	struct wlr_output_state state;
+	wlr_output_state_init(&state);
+	if (wlr_scene_output_build_state(scene_output, &state, NULL)) {
+		if (output_allows_tearing(output)) {
+			state.tearing_page_flip = true;
+			if (!wlr_output_test_state(output->wlr_output, &state)) {
+				state.tearing_page_flip = false;
+			}
+		}
+		wlr_output_commit_state(output->wlr_output, &state);
+	}
+	wlr_output_state_finish(&state);
+}
+
+static void output_render(struct wio_output *output) {
+	struct wlr_output *wlr_output = output->wlr_output;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint32_t commit_seq = wlr_output->commit_seq;
+	output_commit(output);
 
-	struct wlr_output *output = layer_surface->layer_surface->output;
-	double ox = 0, oy = 0;
-	wlr_output_layout_output_coords(
-			layer_surface->server->output_layout, output, &ox, &oy);
-	ox += layer_surface->geo.x + sx, oy += layer_surface->geo.y + sy;
-	struct wlr_render_texture_options options = {
-		.texture = texture,
-		.dst_box = layer_surface->geo,
-		.transform = wlr_output_transform_invert(surface->current.transform),
-	};
-	wlr_render_pass_add_texture(layer_surface->server->render_pass, &options);
-	// Hack because I'm too lazy to fish through a new rdata struct
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_surface_send_frame_done(surface, &now);
+	if (wlr_output->commit_seq != commit_seq) {
+		// Only frames which were actually submitted count
+		int64_t render_ns = timespec_to_nsec(&now) - timespec_to_nsec(&start);
+		output->stats.render_ns += render_ns;
+		output->stats.render_max_ns = MAX(output->stats.render_max_ns, render_ns);
+		// Follows spikes straight away, decays slowly after them
+		output->render_estimate_ns = MAX(render_ns, output->render_estimate_ns
+				- output->render_estimate_ns / 64);
+		output->stats.committed = now;
+		output->stats.commit_seq = wlr_output->commit_seq;
+	}
+	wlr_scene_output_send_frame_done(output->scene_output, &now);
 }
 
-static void render_layer(
-		struct wio_output *output, struct wl_list *layer_surfaces) {
-	struct wio_layer_surface *layer_surface;
-	wl_list_for_each(layer_surface, layer_surfaces, link) {
-		struct wlr_layer_surface_v1 *wlr_layer_surface_v1 =
-			layer_surface->layer_surface;
-		wlr_surface_for_each_surface(wlr_layer_surface_v1->surface,
-			render_layer_surface, layer_surface);
-	}
+static int output_repaint_timer(void *data) {
+	struct wio_output *output = data;
+	output_render(output);
+	return 0;
 }
 
-static void output_frame(struct wl_listener *listener, void *data) {
-	struct wio_output *output = wl_container_of(listener, output, frame);
-	struct wio_server *server = output->server;
-    struct wlr_box box = { 0 };
+/*
+ * Returns how long to wait before rendering, so that the frame is done just
+ * in time for the next vblank and picks up anything clients commit meanwhile.
+ */
+static int output_repaint_delay(struct wio_output *output) {
+	int64_t render_ns;
+	if (output->max_render_time > 0) {
+		render_ns = (int64_t)output->max_render_time * 1000000;
+	} else if (output->max_render_time < 0 && output->render_estimate_ns) {
+		render_ns = output->render_estimate_ns + render_slack_ns;
+	} else {
+		return 0;
+	}
+	if (output->refresh_ns <= 0 || output->last_present.tv_sec == 0) {
+		return 0;
+	}
+	if (output_allows_tearing(output)) {
+		// There is no vblank to wait for
+		return 0;
+	}
 
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t since_ns = timespec_to_nsec(&now)
+		- timespec_to_nsec(&output->last_present);
+	if (since_ns < 0) {
+		return 0;
+	}
+	int64_t next_ns = output->refresh_ns - since_ns % output->refresh_ns;
+	int64_t delay_ns = next_ns - render_ns;
+	return delay_ns > 0 ? delay_ns / 1000000 : 0;
+}
 
-	struct wlr_output *wlr_output = output->wlr_output;
-	struct wlr_output_state *wlr_output_state = output->wlr_output_state;
-	server->render_pass = wlr_output_begin_render_pass(wlr_output, wlr_output_state, NULL, NULL);
-	if (!server->render_pass) {
+static void output_frame(struct wl_listener *listener, void *data) {
+	struct wio_output *output = wl_container_of(listener, output, frame);
+	int delay = output_repaint_delay(output);
+	if (delay > 0) {
+		wl_event_source_timer_update(output->repaint_timer, delay);
 		return;
 	}
-	
-	struct wlr_box frame_box = {
-		.x = 0,
-		.y = 0,
-		.width = output->wlr_output->width,
-		.height = output->wlr_output->height
-	};
-	struct wlr_render_rect_options clear_options = {
-		.box = frame_box,
-		.color = background
-	};
-	wlr_render_pass_add_rect(server->render_pass, &clear_options);
-
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND]);
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM]);
+	output_render(output);
+}
 
-	struct wio_view *view;
-	wl_list_for_each_reverse(view, &server->views, link) {
-		if (!view->xdg_toplevel->base->surface->mapped) {
-			continue;
-		}
-		struct wlr_box box = {
-			.x = view->x,
-			.y = view->y,
-			.width = view->xdg_toplevel->current.width,
-			.height = view->xdg_toplevel->current.height,
-		};
-		render_view_border(server->render_pass, output, view, box, 0);
-		struct render_data rdata = {
-			.output = wlr_output,
-			.view = view,
-			.render_pass = server->render_pass,
-			.when = &now,
-		};
-		wlr_xdg_surface_for_each_surface(view->xdg_toplevel->base,
-				render_surface, &rdata);
+static void output_present(struct wl_listener *listener, void *data) {
+	struct wio_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+	if (!event->presented) {
+		return;
 	}
-	view = server->interactive.view;
-	switch (server->input_state) {
-    case INPUT_STATE_BORDER_DRAG:
-		box = wio_which_box(server);
-		box = wio_canon_box(server, box);
-		render_view_border(server->render_pass, output, NULL, box, 1);
-		break;
-	case INPUT_STATE_MOVE:
-		struct wlr_box box = {
-			.x = server->cursor->x - server->interactive.sx,
-			.y = server->cursor->y - server->interactive.sy,
-			.width = view->xdg_toplevel->current.width,
-			.height = view->xdg_toplevel->current.height,
-		};
-		render_view_border(server->render_pass, output, view, box, 1);
-		break;
-	case INPUT_STATE_NEW_END:
-	case INPUT_STATE_RESIZE_END:
-		box = wio_which_box(server);
-		if (box.width > 0 && box.height > 0) {
-			struct wlr_render_rect_options options = {
-				.box = box,
-				.color = surface
-			};
-			wlr_render_pass_add_rect(server->render_pass, &options);
-		}
-		render_view_border(server->render_pass, output, NULL, box, 1);
-		break;
-	default:
-		break;
+	output->last_present = *event->when;
+	output->refresh_ns = event->refresh;
+	if (event->commit_seq != output->stats.commit_seq) {
+		return;
 	}
 
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP]);
+	int64_t latency_ns = timespec_to_nsec(event->when)
+		- timespec_to_nsec(&output->stats.committed);
+	if (latency_ns < 0) {
+		// Presented on a clock other than CLOCK_MONOTONIC
+		return;
+	}
+	output->stats.latency_ns += latency_ns;
+	output->stats.latency_max_ns = MAX(output->stats.latency_max_ns, latency_ns);
+	// A frame should be on screen by the first vblank after it's committed
+	if (event->refresh > 0) {
+		output->stats.missed += latency_ns / event->refresh;
+	}
 
-	if (server->menu.x != -1 && server->menu.y != -1) {
-		render_menu(output);
+	if (++output->stats.frames < stats_frames) {
+		return;
 	}
+	unsigned int frames = output->stats.frames;
+	wlr_log(WLR_DEBUG, "%s: %u frames, render %.2f/%.2f ms, "
+			"commit to present %.2f/%.2f ms (avg/max), %u missed vblanks, "
+			"%s cursor",
+			output->wlr_output->name, frames,
+			output->stats.render_ns / frames / 1e6,
+			output->stats.render_max_ns / 1e6,
+			output->stats.latency_ns / frames / 1e6,
+			output->stats.latency_max_ns / 1e6,
+			output->stats.missed,
+			output->wlr_output->hardware_cursor ? "hardware" : "software");
+	memset(&output->stats, 0, sizeof(output->stats));
+}
 
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY]);
+static void output_update_background(struct wio_output *output) {
+	struct wlr_box box;
+	wlr_output_layout_get_box(output->server->output_layout,
+			output->wlr_output, &box);
+	wlr_scene_node_set_position(&output->background->node, box.x, box.y);
+	wlr_scene_rect_set_size(output->background, box.width, box.height);
+}
 
-	wlr_output_add_software_cursors_to_render_pass(wlr_output, server->render_pass, NULL);
-	wlr_render_pass_submit(server->render_pass);
-	wlr_output_commit_state(wlr_output, wlr_output_state);
+void server_output_layout_change(struct wl_listener *listener, void *data) {
+	struct wio_server *server = wl_container_of(listener, server, output_layout_change);
+	struct wio_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		output_update_background(output);
+	}
+	wio_update_view_outputs(server);
 }
 
 static void output_destroy(struct wl_listener *listener, void *data) {
@@ -383,12 +392,50 @@ static void output_destroy(struct wl_listener *listener, void *data) {
 	struct wio_output *output = wlr_output->data;
 	struct wio_server *server = output->server;
 
+	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
+	wl_list_remove(&output->destroy.link);
+	wl_event_source_remove(output->repaint_timer);
+	wlr_scene_node_destroy(&output->background->node);
+
 	wl_list_remove(&output->link);
 	if (wl_list_empty(&server->outputs)) {
 		wl_display_terminate(server->wl_display);
 	}
 }
 
+/*
+ * Picks the mode with the configured size (or the preferred mode's size), at
+ * the configured refresh rate if there is one, otherwise at the highest.
+ */
+static struct wlr_output_mode *output_pick_mode(struct wlr_output *wlr_output,
+		struct wio_output_config *config) {
+	struct wlr_output_mode *preferred = wlr_output_preferred_mode(wlr_output);
+	int width = config->width, height = config->height;
+	if ((!width || !height) && preferred) {
+		width = preferred->width;
+		height = preferred->height;
+	}
+
+	struct wlr_output_mode *mode, *best = NULL;
+	wl_list_for_each(mode, &wlr_output->modes, link) {
+		if (mode->width != width || mode->height != height) {
+			continue;
+		}
+		if (!best) {
+			best = mode;
+		} else if (config->refresh) {
+			if (abs(mode->refresh - config->refresh)
+					< abs(best->refresh - config->refresh)) {
+				best = mode;
+			}
+		} else if (mode->refresh > best->refresh) {
+			best = mode;
+		}
+	}
+	return best ? best : preferred;
+}
+
 void server_new_output(struct wl_listener *listener, void *data) {
 	struct wio_server *server = wl_container_of(listener, server, new_output);
 	struct wlr_output *wlr_output = data;
@@ -401,8 +448,16 @@ void server_new_output(struct wl_listener *listener, void *data) {
 	// TODO(rubo): also call wlr_output_state_finish(output->wlr_output_state);
 	wlr_output_state_init(output->wlr_output_state);
 	output->server = server;
+	output->scene_output = wlr_scene_output_create(server->scene, wlr_output);
+	output->background = wlr_scene_rect_create(server->background_tree,
+			0, 0, background);
 	output->frame.notify = output_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
+	output->repaint_timer = wl_event_loop_add_timer(
+			wl_display_get_event_loop(server->wl_display),
+			output_repaint_timer, output);
+	output->present.notify = output_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
 	wl_list_insert(&server->outputs, &output->link);
 	wlr_output->data = output;
 
@@ -422,44 +477,49 @@ void server_new_output(struct wl_listener *listener, void *data) {
 		}
 	}
 
+	struct wlr_output_layout_output *layout_output;
 	if (config) {
 		if (config->x == -1 && config->y == -1)
-			wlr_output_layout_add_auto(server->output_layout, wlr_output);
+			layout_output = wlr_output_layout_add_auto(server->output_layout, wlr_output);
 		else {
-			wlr_output_layout_add(server->output_layout, wlr_output,
+			layout_output = wlr_output_layout_add(server->output_layout, wlr_output,
 					config->x, config->y);
 		}
-		bool modeset = false;
-		if (config->width && config->height
-		&& !wl_list_empty(&wlr_output->modes)) {
-			struct wlr_output_mode *mode;
-			wl_list_for_each(mode, &wlr_output->modes, link) {
-				if (mode->width == config->width
-						&& mode->height == config->height) {
-					wlr_output_state_set_mode(output->wlr_output_state, mode);
-					modeset = true;
-				}
-			}
-		}
-		if (!modeset) {
-			struct wlr_output_mode *mode =
-				wlr_output_preferred_mode(wlr_output);
-			if (mode)
-				wlr_output_state_set_mode(output->wlr_output_state, mode);
-		}
+		struct wlr_output_mode *mode = output_pick_mode(wlr_output, config);
+		if (mode)
+			wlr_output_state_set_mode(output->wlr_output_state, mode);
 		if (config->scale)
 			wlr_output_state_set_scale(output->wlr_output_state, config->scale);
 		if (config->transform)
 			wlr_output_state_set_transform(output->wlr_output_state, config->transform);
+		output->max_render_time = config->max_render_time;
+		output->tearing = config->tearing;
 		wlr_output_state_set_enabled(output->wlr_output_state, true);
+		if (config->adaptive_sync) {
+			wlr_output_state_set_adaptive_sync_enabled(
+					output->wlr_output_state, true);
+			if (!wlr_output_test_state(wlr_output, output->wlr_output_state)) {
+				wlr_log(WLR_INFO, "%s: adaptive sync is not supported",
+						wlr_output->name);
+				wlr_output_state_set_adaptive_sync_enabled(
+						output->wlr_output_state, false);
+			}
+		}
 	} else {
 		struct wlr_output_mode *mode = wlr_output_preferred_mode(wlr_output);
 		if (mode)
 			wlr_output_state_set_mode(output->wlr_output_state, mode);
 		wlr_output_state_set_enabled(output->wlr_output_state, true);
-		wlr_output_layout_add_auto(server->output_layout, wlr_output);
+		layout_output = wlr_output_layout_add_auto(server->output_layout, wlr_output);
 	}
+	wlr_scene_output_layout_add_output(server->scene_layout,
+			layout_output, output->scene_output);
 
 	wlr_output_commit_state(wlr_output, output->wlr_output_state);
+	if (config && config->adaptive_sync) {
+		wlr_log(WLR_INFO, "%s: adaptive sync %s", wlr_output->name,
+				wlr_output->adaptive_sync_status == WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED
+				? "enabled" : "disabled");
+	}
 	wlr_output_create_global(wlr_output, server->wl_display);
 }
@@ -1,11 +1,20 @@
+#define _POSIX_C_SOURCE 200112L
 #include <assert.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <wayland-server.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/types/wlr_subcompositor.h>
+#include <wlr/types/wlr_xdg_activation_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/util/box.h>
 
 #include "xdg-shell-protocol.h"
+#include "colors.h"
 #include "server.h"
 #include "view.h"
 
@@ -13,32 +22,473 @@
 #define less_swap1(A, B) { if (A < B) { int C = A; A = B; B = C + window_border * 2; } }
 #define less_swap2(A, B) { if (A < B) { int C = A; A = B - window_border * 2; B = C; } }
 
-static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
-	struct wio_view *view = wl_container_of(listener, view, map);
+// Occluded and offscreen views get frame callbacks this often, in ms
+static const int hidden_frame_interval = 1000;
+
+// Size of a view index cell, in layout coordinates
+static const int view_index_cell = 256;
+
+// Added to the stack of fullscreen views, which the scene draws above the rest
+static const uint64_t fullscreen_stack = UINT64_C(1) << 63;
+
+/*
+ * The scene draws the window geometry at view->x/y; the root surface may
+ * start above and to the left of it, e.g. for client-side shadows.
+ */
+static struct wlr_box view_geometry(struct wio_view *view) {
+	struct wlr_box geo;
+	wlr_xdg_surface_get_geometry(view->xdg_toplevel->base, &geo);
+	return geo;
+}
+
+static bool view_update_borders(struct wio_view *view, bool force) {
+	struct wlr_xdg_toplevel *toplevel = view->xdg_toplevel;
+	struct wlr_box geo = view_geometry(view);
+	// Borders follow the toplevel size, the window may overflow it
+	int width = toplevel->current.width > geo.width ?
+		toplevel->current.width : geo.width;
+	int height = toplevel->current.height > geo.height ?
+		toplevel->current.height : geo.height;
+	bool activated = toplevel->current.activated;
+	if (!force && width == view->width && height == view->height
+			&& activated == view->activated) {
+		return false;
+	}
+	view->width = width;
+	view->height = height;
+	view->activated = activated;
+	wio_set_borders(view->borders, width, height,
+			activated ? active_border : inactive_border);
+	return true;
+}
+
+static bool view_update_opaque(struct wio_view *view) {
+	struct wlr_surface *surface = view->xdg_toplevel->base->surface;
+	struct wlr_box geo = view_geometry(view);
+	pixman_box32_t box = {
+		.x1 = geo.x, .y1 = geo.y,
+		.x2 = geo.x + geo.width, .y2 = geo.y + geo.height,
+	};
+	bool opaque = pixman_region32_contains_rectangle(
+			&surface->opaque_region, &box) == PIXMAN_REGION_IN;
+	if (opaque == view->opaque) {
+		return false;
+	}
+	view->opaque = opaque;
+	return true;
+}
+
+static void view_update_outputs(struct wio_view *view) {
 	struct wio_server *server = view->server;
-	wio_view_focus(view, view->xdg_toplevel->base->surface);
+	if (view->fullscreen) {
+		// Sits at the origin of its output, with no borders to spill over
+		struct wlr_output *wlr_output = wlr_output_layout_output_at(
+				server->output_layout, view->x, view->y);
+		struct wio_output *output = wlr_output ? wlr_output->data : NULL;
+		view->outputs = output && output->scene_output
+			? (uint64_t)1 << output->scene_output->index : 0;
+		return;
+	}
+	struct wlr_box box = {
+		.x = view->x - window_border,
+		.y = view->y - window_border,
+		.width = view->width + window_border * 2,
+		.height = view->height + window_border * 2,
+	};
+	uint64_t outputs = 0;
+	struct wio_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_box output_box, intersection;
+		wlr_output_layout_get_box(server->output_layout,
+				output->wlr_output, &output_box);
+		if (wlr_box_intersection(&intersection, &box, &output_box)) {
+			outputs |= (uint64_t)1 << output->scene_output->index;
+		}
+	}
+	view->outputs = outputs;
+}
+
+static int index_cell(int coord) {
+	// Rounds towards negative infinity, views can be left of or above 0,0
+	return coord >= 0 ? coord / view_index_cell
+		: -((-coord + view_index_cell - 1) / view_index_cell);
+}
+
+static struct wio_view_bucket *index_bucket(struct wio_server *server,
+		int cx, int cy) {
+	uint32_t hash = (uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u;
+	return &server->view_index[hash % countof(server->view_index)];
+}
+
+static void bucket_add(struct wio_view_bucket *bucket, struct wio_view *view) {
+	for (size_t i = 0; i < bucket->len; ++i) {
+		if (bucket->views[i] == view) {
+			// Another cell of the view hashed here
+			return;
+		}
+	}
+	if (bucket->len == bucket->cap) {
+		bucket->cap = bucket->cap ? bucket->cap * 2 : 8;
+		bucket->views = realloc(bucket->views,
+				bucket->cap * sizeof(*bucket->views));
+	}
+	bucket->views[bucket->len++] = view;
+}
+
+static void bucket_remove(struct wio_view_bucket *bucket, struct wio_view *view) {
+	for (size_t i = 0; i < bucket->len; ++i) {
+		if (bucket->views[i] == view) {
+			bucket->views[i] = bucket->views[--bucket->len];
+			return;
+		}
+	}
+}
+
+static void view_index_foreach(struct wio_view *view,
+		void (*fn)(struct wio_view_bucket *, struct wio_view *)) {
+	struct wio_server *server = view->server;
+	struct wlr_box *box = &view->index_box;
+	int cx1 = index_cell(box->x), cx2 = index_cell(box->x + box->width - 1);
+	int cy1 = index_cell(box->y), cy2 = index_cell(box->y + box->height - 1);
+	if ((int64_t)(cx2 - cx1 + 1) * (cy2 - cy1 + 1)
+			>= (int64_t)countof(server->view_index)) {
+		// Covers about every bucket anyway
+		for (size_t i = 0; i < countof(server->view_index); ++i) {
+			fn(&server->view_index[i], view);
+		}
+		return;
+	}
+	for (int cy = cy1; cy <= cy2; ++cy) {
+		for (int cx = cx1; cx <= cx2; ++cx) {
+			fn(index_bucket(server, cx, cy), view);
+		}
+	}
+}
+
+static void view_index_remove(struct wio_view *view) {
+	if (view->indexed) {
+		view_index_foreach(view, bucket_remove);
+		view->indexed = false;
+	}
+}
+
+/*
+ * Re-files the view under its current bounding box: the surface with its
+ * subsurfaces, and the borders. Needed whenever the view maps, unmaps,
+ * moves or resizes; raising it only bumps view->stack.
+ */
+static void view_index_update(struct wio_view *view) {
+	struct wlr_surface *surface = view->xdg_toplevel->base->surface;
+	if (!surface->mapped) {
+		view_index_remove(view);
+		return;
+	}
+	struct wlr_box geo = view_geometry(view);
+	struct wlr_box extent;
+	wlr_surface_get_extends(surface, &extent);
+	extent.x += view->x - geo.x;
+	extent.y += view->y - geo.y;
+	int x1 = MIN(extent.x, view->x - window_border);
+	int y1 = MIN(extent.y, view->y - window_border);
+	int x2 = MAX(extent.x + extent.width, view->x + view->width + window_border);
+	int y2 = MAX(extent.y + extent.height, view->y + view->height + window_border);
+	struct wlr_box box = { .x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1 };
+	if (view->indexed && wlr_box_equal(&box, &view->index_box)) {
+		return;
+	}
+	view_index_remove(view);
+	view->index_box = box;
+	view_index_foreach(view, bucket_add);
+	view->indexed = true;
+}
+
+/*
+ * Puts the view at the head of server->views and the top of the stack,
+ * where wio_view_focus and fullscreen changes put it in the scene.
+ */
+static void view_raise(struct wio_view *view) {
+	struct wio_server *server = view->server;
+	view->stack = ++server->stack_seq | (view->fullscreen ? fullscreen_stack : 0);
+	wl_list_remove(&view->link);
+	wl_list_insert(&server->views, &view->link);
+}
+
+static void view_update_enabled(struct wio_view *view) {
+	bool enabled = view->xdg_toplevel->base->surface->mapped
+		&& !view->occluded && !view->pooled && !view->claiming;
+	wlr_scene_node_set_enabled(&view->scene_tree->node, enabled);
+}
+
+static void occlude_views(struct wio_server *server,
+		pixman_region32_t *covered, bool fullscreen) {
+	struct wio_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		struct wlr_xdg_surface *xdg_surface = view->xdg_toplevel->base;
+		if (view->fullscreen != fullscreen || !xdg_surface->surface->mapped
+				|| view->claiming) {
+			continue;
+		}
+		struct wlr_box geo = view_geometry(view);
+		struct wlr_box extent;
+		wlr_surface_get_extends(xdg_surface->surface, &extent);
+		extent.x += view->x - geo.x;
+		extent.y += view->y - geo.y;
+		pixman_box32_t box = {
+			.x1 = extent.x, .y1 = extent.y,
+			.x2 = extent.x + extent.width, .y2 = extent.y + extent.height,
+		};
+		if (!fullscreen) {
+			// Include the borders
+			box.x1 = MIN(box.x1, view->x - window_border);
+			box.y1 = MIN(box.y1, view->y - window_border);
+			box.x2 = MAX(box.x2, view->x + view->width + window_border);
+			box.y2 = MAX(box.y2, view->y + view->height + window_border);
+		}
+		// Popups aren't included in the extent, never hide their parent
+		bool occluded = wl_list_empty(&xdg_surface->popups) && (view->outputs == 0
+			|| pixman_region32_contains_rectangle(covered, &box) == PIXMAN_REGION_IN);
+		if (occluded != view->occluded) {
+			view->occluded = occluded;
+			view_update_enabled(view);
+		}
+		if (occluded || !view->opaque) {
+			continue;
+		}
+		pixman_region32_union_rect(covered, covered,
+				view->x, view->y, geo.width, geo.height);
+		if (!fullscreen) {
+			for (size_t i = 0; i < countof(view->borders); ++i) {
+				struct wlr_scene_rect *rect = view->borders[i];
+				pixman_region32_union_rect(covered, covered,
+						view->x + rect->node.x, view->y + rect->node.y,
+						rect->width, rect->height);
+			}
+		}
+	}
+}
+
+static void send_frame_done_iterator(struct wlr_surface *surface,
+		int sx, int sy, void *data) {
+	wlr_surface_send_frame_done(surface, data);
+}
+
+static bool send_hidden_frame_done(struct wio_server *server) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bool hidden = false;
+	struct wio_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		if (view->occluded && view->xdg_toplevel->base->surface->mapped) {
+			wlr_xdg_surface_for_each_surface(view->xdg_toplevel->base,
+					send_frame_done_iterator, &now);
+			hidden = true;
+		}
+	}
+	return hidden;
+}
+
+static int hidden_frame_timer(void *data) {
+	struct wio_server *server = data;
+	server->hidden_frame_armed = send_hidden_frame_done(server);
+	if (server->hidden_frame_armed) {
+		wl_event_source_timer_update(server->hidden_frame_timer,
+				hidden_frame_interval);
+	}
+	return 0;
+}
+
+/*
+ * The scene only sends frame callbacks to visible surfaces, from their
+ * primary output. Hidden views would then stop receiving them altogether;
+ * instead they get one every hidden_frame_interval, so they stay alive
+ * and reasonably fresh without redrawing at the refresh rate.
+ */
+static void arm_hidden_frame_timer(struct wio_server *server) {
+	if (server->hidden_frame_armed) {
+		return;
+	}
+	if (!server->hidden_frame_timer) {
+		struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+		server->hidden_frame_timer = wl_event_loop_add_timer(loop,
+				hidden_frame_timer, server);
+	}
+	wl_event_source_timer_update(server->hidden_frame_timer,
+			hidden_frame_interval);
+	server->hidden_frame_armed = true;
+}
+
+/*
+ * Disables the scene nodes of views which are entirely hidden behind opaque
+ * views, so the scene doesn't have to consider them at all. Only needs to
+ * run when the stacking order, geometry or opacity of a view changes.
+ */
+void wio_update_occlusion(struct wio_server *server) {
+	pixman_region32_t covered;
+	pixman_region32_init(&covered);
+	occlude_views(server, &covered, true);
+	occlude_views(server, &covered, false);
+	pixman_region32_fini(&covered);
+
+	struct wio_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		if (view->occluded) {
+			arm_hidden_frame_timer(server);
+			break;
+		}
+	}
+}
+
+/*
+ * Recomputes the set of outputs each view is on, after the output layout
+ * changed. Moving or resizing a single view updates just that view.
+ */
+void wio_update_view_outputs(struct wio_server *server) {
+	struct wio_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		view_update_outputs(view);
+	}
+	wio_update_occlusion(server);
+}
+
+static void view_show(struct wio_view *view) {
+	struct wio_server *server = view->server;
+	view->claiming = false;
+	view_update_borders(view, true);
+	view_update_opaque(view);
+	view_update_enabled(view);
 
 	struct wlr_output *output = wlr_output_layout_output_at(
 			server->output_layout, server->cursor->x, server->cursor->y);
 	struct wlr_output_layout_output *layout = wlr_output_layout_get(
 			server->output_layout, output);
 	if (view->x == -1 || view->y == -1) {
-		struct wlr_surface_state *current =
-			&view->xdg_toplevel->base->surface->current;
+		struct wlr_box geo = view_geometry(view);
 		int owidth, oheight;
 		wlr_output_effective_resolution(output, &owidth, &oheight);
 		wio_view_move(view,
-				layout->x + (owidth / 2 - current->width / 2),
-				layout->y + (oheight / 2 - current->height / 2));
+				layout->x + (owidth / 2 - geo.width / 2),
+				layout->y + (oheight / 2 - geo.height / 2));
 	} else {
-		// Sends wl_surface_enter
 		wio_view_move(view, view->x, view->y);
 	}
+	// Needs view->outputs, to know which fullscreen views give way
+	wio_view_focus(view, view->xdg_toplevel->base->surface);
+	if (view->xdg_toplevel->requested.fullscreen) {
+		wio_view_set_fullscreen(view, true,
+				view->xdg_toplevel->requested.fullscreen_output);
+	}
+}
+
+static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
+	struct wio_view *view = wl_container_of(listener, view, map);
+	if (view->pooled) {
+		// Stays hidden until wio_pool_claim
+		return;
+	}
+	view_show(view);
+}
+
+/*
+ * Hands a mapped pool window to New: it only has to be resized into the
+ * drawn box, rather than waiting for a shell, cage and a terminal to start.
+ * It stays hidden until it has been redrawn at the new size.
+ */
+bool wio_pool_claim(struct wio_server *server, struct wlr_box box) {
+	struct wio_view *view;
+	wl_list_for_each(view, &server->pool, link) {
+		if (!view->xdg_toplevel->base->surface->mapped) {
+			continue;
+		}
+		view->pooled = false;
+		view_raise(view);
+		view->x = box.x;
+		view->y = box.y;
+		view->claiming = true;
+		view->claim_serial = wlr_xdg_toplevel_set_size(view->xdg_toplevel,
+				box.width, box.height);
+		// Hidden views get no frame callbacks from the scene, and some
+		// clients wait for one before drawing at the new size
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wlr_xdg_surface_for_each_surface(view->xdg_toplevel->base,
+				send_frame_done_iterator, &now);
+		return true;
+	}
+	return false;
+}
+
+static void xdg_toplevel_unmap(struct wl_listener *listener, void *data) {
+	struct wio_view *view = wl_container_of(listener, view, unmap);
+	view_index_remove(view);
+	view->occluded = false;
+	view_update_enabled(view);
+	wio_update_occlusion(view->server);
+}
+
+static pid_t parent_pid(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	char buf[512];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+	// The command name may contain anything, skip past its closing paren
+	char *end = strrchr(buf, ')');
+	pid_t ppid;
+	if (!end || sscanf(end + 1, " %*c %d", &ppid) != 1) {
+		return -1;
+	}
+	return ppid;
+}
+
+/*
+ * In direct mode, programs started from a terminal connect to wio rather
+ * than to a cage of their own. Like in rio, they take over the window of
+ * the terminal they were started from.
+ */
+static void view_inherit_geometry(struct wio_view *view, pid_t pid) {
+	for (int depth = 0; depth < 16 && pid > 1; ++depth) {
+		pid = parent_pid(pid);
+		struct wio_view *parent;
+		wl_list_for_each(parent, &view->server->views, link) {
+			if (parent->pid != pid || !parent->xdg_toplevel->base->surface->mapped) {
+				continue;
+			}
+			view->x = parent->x;
+			view->y = parent->y;
+			wlr_xdg_toplevel_set_size(view->xdg_toplevel,
+					parent->xdg_toplevel->current.width,
+					parent->xdg_toplevel->current.height);
+			return;
+		}
+	}
 }
 
 static void xdg_toplevel_commit(struct wl_listener *listener, void *data) {
 	struct wio_view *view = wl_container_of(listener, view, commit);
-	if (!view->xdg_toplevel->base->initial_commit) {
+	struct wlr_xdg_toplevel *toplevel = view->xdg_toplevel;
+	if (!toplevel->base->initial_commit) {
+		if (view->claiming && toplevel->base->surface->mapped
+				&& (int32_t)(toplevel->base->current.configure_serial
+					- view->claim_serial) >= 0) {
+			view_show(view);
+			return;
+		}
+		if (toplevel->base->surface->mapped && !view->pooled && !view->claiming) {
+			bool resized = view_update_borders(view, false);
+			if (resized) {
+				view_update_outputs(view);
+			}
+			// Subsurfaces may have grown even if the view didn't
+			view_index_update(view);
+			if (view_update_opaque(view) || resized) {
+				wio_update_occlusion(view->server);
+			}
+		}
 		return;
 	}
 	wlr_xdg_toplevel_set_tiled(view->xdg_toplevel,
@@ -48,26 +498,64 @@ static void xdg_toplevel_commit(struct wl_listener *listener, void *data) {
 	gid_t gid;
 	struct wl_client *client = wl_resource_get_client(view->xdg_toplevel->resource);
 	wl_client_get_credentials(client, &pid, &uid, &gid);
-	struct wio_new_view *new_view;
-	wl_list_for_each(new_view, &view->server->new_views, link) {
-		if (new_view->pid != pid) {
-			continue;
+	view->pid = pid;
+	struct wio_new_view *new_view = view->placement;
+	if (!new_view) {
+		// Clients that don't pass the token on are matched by pid
+		struct wio_new_view *pending;
+		wl_list_for_each(pending, &view->server->new_views, link) {
+			if (pending->pid == pid) {
+				new_view = pending;
+				break;
+			}
 		}
-		view->x = new_view->box.x;
-		view->y = new_view->box.y;
-		wlr_xdg_toplevel_set_size(view->xdg_toplevel, new_view->box.width, new_view->box.height);
-		wl_list_remove(&new_view->link);
-		free(new_view);
-		break;
 	}
-	wl_list_insert(&view->server->views, &view->link);
+	if (new_view) {
+		if (new_view->pooled) {
+			// Left at the size the client picks until it is claimed
+			view->pooled = true;
+		} else {
+			view->x = new_view->box.x;
+			view->y = new_view->box.y;
+			wlr_xdg_toplevel_set_size(view->xdg_toplevel, new_view->box.width, new_view->box.height);
+		}
+		wio_new_view_destroy(new_view);
+	} else if (view->server->direct) {
+		view_inherit_geometry(view, pid);
+	}
+	if (view->pooled) {
+		wl_list_insert(&view->server->pool, &view->link);
+		return;
+	}
+	view_raise(view);
+}
+
+static void xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data) {
+	struct wio_view *view = wl_container_of(listener, view, request_fullscreen);
+	struct wlr_xdg_toplevel *toplevel = view->xdg_toplevel;
+	if (!toplevel->base->surface->mapped) {
+		// Applied on map, configures can't be sent before the initial commit
+		return;
+	}
+	wio_view_set_fullscreen(view, toplevel->requested.fullscreen,
+			toplevel->requested.fullscreen_output);
+	// The request must be answered even if it didn't change anything
+	wlr_xdg_surface_schedule_configure(toplevel->base);
 }
 
 static void xdg_toplevel_destroy(struct wl_listener *listener, void *data) {
 	struct wio_view *view = wl_container_of(listener, view, destroy);
+	wl_list_remove(&view->map.link);
+	wl_list_remove(&view->unmap.link);
 	wl_list_remove(&view->commit.link);
+	wl_list_remove(&view->request_fullscreen.link);
 	wl_list_remove(&view->destroy.link);
 	wl_list_remove(&view->link);
+	if (view->placement) {
+		wio_new_view_destroy(view->placement);
+	}
+	view_index_remove(view);
+	wlr_scene_node_destroy(&view->scene_tree->node);
 	free(view);
 }
 
@@ -79,13 +567,103 @@ void server_xdg_shell_new_toplevel(struct wl_listener *listener, void *data) {
 	view->server = server;
 	view->xdg_toplevel = xdg_toplevel;
 	view->x = view->y = -1;
+	wl_list_init(&view->link);
+
+	view->scene_tree = wlr_scene_tree_create(server->view_tree);
+	view->scene_tree->node.data = view;
+	xdg_toplevel->base->data = view;
+	wlr_scene_node_set_enabled(&view->scene_tree->node, false);
+	wio_create_borders(view->scene_tree, view->borders, inactive_border);
+	wlr_scene_xdg_surface_create(view->scene_tree, xdg_toplevel->base);
 
 	view->map.notify = xdg_toplevel_map;
 	wl_signal_add(&xdg_toplevel->base->surface->events.map, &view->map);
+	view->unmap.notify = xdg_toplevel_unmap;
+	wl_signal_add(&xdg_toplevel->base->surface->events.unmap, &view->unmap);
 	view->commit.notify = xdg_toplevel_commit;
 	wl_signal_add(&xdg_toplevel->base->surface->events.commit, &view->commit);
+	view->request_fullscreen.notify = xdg_toplevel_request_fullscreen;
+	wl_signal_add(&xdg_toplevel->events.request_fullscreen, &view->request_fullscreen);
 	view->destroy.notify = xdg_toplevel_destroy;
-	wl_signal_add(&xdg_toplevel->base->surface->events.destroy, &view->destroy);
+	wl_signal_add(&xdg_toplevel->events.destroy, &view->destroy);
+}
+
+static void new_view_token_destroy(struct wl_listener *listener, void *data) {
+	struct wio_new_view *new_view = wl_container_of(listener, new_view, token_destroy);
+	wl_list_remove(&new_view->token_destroy.link);
+	new_view->token = NULL;
+	if (!new_view->view) {
+		// Expired before its window showed up
+		wio_new_view_destroy(new_view);
+	}
+}
+
+struct wio_new_view *wio_new_view_create(struct wio_server *server,
+		struct wlr_box box, bool pooled) {
+	struct wio_new_view *new_view = calloc(1, sizeof(struct wio_new_view));
+	new_view->box = box;
+	new_view->pooled = pooled;
+	new_view->token = wlr_xdg_activation_token_v1_create(server->xdg_activation);
+	if (!new_view->token) {
+		free(new_view);
+		return NULL;
+	}
+	new_view->token->data = new_view;
+	new_view->token_destroy.notify = new_view_token_destroy;
+	wl_signal_add(&new_view->token->events.destroy, &new_view->token_destroy);
+	wl_list_insert(&server->new_views, &new_view->link);
+	return new_view;
+}
+
+void wio_new_view_destroy(struct wio_new_view *new_view) {
+	if (new_view->token) {
+		wl_list_remove(&new_view->token_destroy.link);
+		wlr_xdg_activation_token_v1_destroy(new_view->token);
+	}
+	if (new_view->view) {
+		new_view->view->placement = NULL;
+	}
+	wl_list_remove(&new_view->link);
+	free(new_view);
+}
+
+void server_xdg_activation_request(struct wl_listener *listener, void *data) {
+	struct wlr_xdg_activation_v1_request_activate_event *event = data;
+	struct wlr_xdg_toplevel *toplevel =
+		wlr_xdg_toplevel_try_from_wlr_surface(event->surface);
+	if (!toplevel || !toplevel->base->data) {
+		return;
+	}
+	struct wio_view *view = toplevel->base->data;
+	struct wio_new_view *new_view = event->token->data;
+	if (!new_view) {
+		// Only New's own tokens are honoured: others aren't checked against
+		// a seat or serial, and would let any client take focus
+		return;
+	}
+	// wlroots destroys the token once this returns
+	wl_list_remove(&new_view->token_destroy.link);
+	new_view->token = NULL;
+	if (!toplevel->base->initialized) {
+		// Configures can't be sent yet, the initial commit places it
+		if (view->placement) {
+			wio_new_view_destroy(view->placement);
+		}
+		view->placement = new_view;
+		new_view->view = view;
+		return;
+	}
+	if (!new_view->pooled && !view->pooled) {
+		// Activated after it was set up, move it into the drawn box
+		wlr_xdg_toplevel_set_size(toplevel, new_view->box.width, new_view->box.height);
+		if (toplevel->base->surface->mapped) {
+			wio_view_move(view, new_view->box.x, new_view->box.y);
+		} else {
+			view->x = new_view->box.x;
+			view->y = new_view->box.y;
+		}
+	}
+	wio_new_view_destroy(new_view);
 }
 
 static void xdg_toplevel_decoration_request_mode(struct wl_listener *listener, void *data) {
@@ -142,20 +720,37 @@ void wio_view_focus(struct wio_view *view, struct wlr_surface *surface) {
 		assert(previous);
 		wlr_xdg_toplevel_set_activated(previous, false);
 	}
+	if (!view->fullscreen) {
+		// It would be drawn below them, fullscreen views on its outputs give way
+		struct wio_view *other, *tmp;
+		wl_list_for_each_safe(other, tmp, &server->views, link) {
+			if (other->fullscreen && (other->outputs & view->outputs)) {
+				wio_view_set_fullscreen(other, false, NULL);
+			}
+		}
+	}
 	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
 	wlr_xdg_toplevel_set_activated(view->xdg_toplevel, true);
-	wlr_seat_keyboard_notify_enter(seat, view->xdg_toplevel->base->surface,
-			keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+	if (keyboard) {
+		wlr_seat_keyboard_notify_enter(seat, view->xdg_toplevel->base->surface,
+				keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+	} else {
+		// No keymap has been compiled yet
+		wlr_seat_keyboard_notify_enter(seat, view->xdg_toplevel->base->surface,
+				NULL, 0, NULL);
+	}
 	/* bring to front */
-	wl_list_remove(&view->link);
-	wl_list_insert(&view->server->views, &view->link);
+	view_raise(view);
+	wlr_scene_node_raise_to_top(&view->scene_tree->node);
+	wio_update_occlusion(server);
 }
 
 static bool view_at(struct wio_view *view,
 		double lx, double ly, struct wlr_surface **surface,
 		double *sx, double *sy) {
-	double view_sx = lx - view->x;
-	double view_sy = ly - view->y;
+	struct wlr_box geo = view_geometry(view);
+	double view_sx = lx - view->x + geo.x;
+	double view_sy = ly - view->y + geo.y;
 
 	double _sx, _sy;
 	struct wlr_surface *_surface = NULL;
@@ -189,43 +784,147 @@ static int which_corner(struct wlr_box *box, int x, int y) {
 	return 3*j+i;
 }
 
-struct wio_view *wio_view_at(struct wio_server *server, double lx, double ly,
+static bool view_hit(struct wio_view *view, double lx, double ly,
 		struct wlr_surface **surface, double *sx, double *sy) {
+	// Surface
+	if (view_at(view, lx, ly, surface, sx, sy)) {
+		view->area = VIEW_AREA_SURFACE;
+		return true;
+	}
+	// Border
 	struct wlr_box border_box = {
-		.x = 0, .y = 0,
-		.width = 0, .height = 0,
+		.x = view->x - window_border,
+		.y = view->y - window_border,
+		.width = view->width + window_border * 2,
+		.height = view->height + window_border * 2,
 	};
-	struct wio_view *view;
-	wl_list_for_each(view, &server->views, link) {
-		// Surface
-		if (view_at(view, lx, ly, surface, sx, sy)) {
-			view->area = VIEW_AREA_SURFACE;
-			return view;
+	if (wlr_box_contains_point(&border_box, lx, ly)) {
+		view->area = which_corner(&border_box, lx, ly);
+		*sx = lx - view->x;
+		*sy = ly - view->y;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Only the views filed in the index bucket under the point are considered,
+ * from the top of the stack down, so the cost doesn't grow with the number
+ * of views elsewhere on the screens.
+ */
+struct wio_view *wio_view_at(struct wio_server *server, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy) {
+	if (!wl_list_empty(&server->views)) {
+		// Popups aren't indexed, and only the focused view has them open
+		struct wio_view *top = wl_container_of(server->views.next, top, link);
+		if (!wl_list_empty(&top->xdg_toplevel->base->popups)
+				&& view_hit(top, lx, ly, surface, sx, sy)) {
+			return top;
 		}
-		// Border
-		border_box.x = view->x - window_border;
-		border_box.y = view->y - window_border;
-		border_box.width = view->xdg_toplevel->base->surface->current.width + window_border * 2;
-		border_box.height = view->xdg_toplevel->base->surface->current.height + window_border * 2;
-		if (wlr_box_contains_point(&border_box, lx, ly)) {
-			view->area = which_corner(&border_box, lx, ly);
-			*sx = lx - view->x;
-			*sy = ly - view->y;
+	}
+
+	struct wio_view_bucket *bucket = index_bucket(server,
+			index_cell(floor(lx)), index_cell(floor(ly)));
+	uint64_t below = UINT64_MAX;
+	for (;;) {
+		struct wio_view *view = NULL;
+		for (size_t i = 0; i < bucket->len; ++i) {
+			struct wio_view *candidate = bucket->views[i];
+			if (candidate->stack < below
+					&& (!view || candidate->stack > view->stack)
+					&& wlr_box_contains_point(&candidate->index_box, lx, ly)) {
+				view = candidate;
+			}
+		}
+		if (!view) {
+			return NULL;
+		}
+		if (view_hit(view, lx, ly, surface, sx, sy)) {
 			return view;
 		}
+		// Missed its input region, try the next one down
+		below = view->stack;
+	}
+}
+
+/*
+ * Layout coordinates of the origin of one of the view's surfaces, which
+ * may be a subsurface of its toplevel.
+ */
+void wio_view_surface_origin(struct wio_view *view, struct wlr_surface *surface,
+		int *lx, int *ly) {
+	struct wlr_box geo = view_geometry(view);
+	int x = view->x - geo.x, y = view->y - geo.y;
+	struct wlr_subsurface *subsurface;
+	while ((subsurface = wlr_subsurface_try_from_wlr_surface(surface))) {
+		x += subsurface->current.x;
+		y += subsurface->current.y;
+		surface = subsurface->parent;
 	}
-	return NULL;
+	*lx = x;
+	*ly = y;
 }
 
 void wio_view_move(struct wio_view *view, int x, int y) {
 	view->x = x;
 	view->y = y;
+	// The scene sends wl_surface.enter/leave as the view crosses outputs
+	wlr_scene_node_set_position(&view->scene_tree->node, x, y);
+	view_update_outputs(view);
+	view_index_update(view);
+	wio_update_occlusion(view->server);
+}
 
-	// Cheating as FUCK because I'm lazy
-	struct wio_output *output;
-	wl_list_for_each(output, &view->server->outputs, link) {
-		wlr_surface_send_enter(view->xdg_toplevel->base->surface, output->wlr_output);
+void wio_view_set_fullscreen(struct wio_view *view, bool fullscreen,
+		struct wlr_output *output) {
+	struct wio_server *server = view->server;
+	if (view->fullscreen == fullscreen) {
+		return;
+	}
+	if (fullscreen) {
+		if (!output) {
+			output = wlr_output_layout_output_at(server->output_layout,
+					view->x + view->width / 2, view->y + view->height / 2);
+		}
+		struct wio_output *wio_output;
+		wl_list_for_each(wio_output, &server->outputs, link) {
+			uint64_t mask = (uint64_t)1 << wio_output->scene_output->index;
+			if (!output && (view->outputs & mask)) {
+				output = wio_output->wlr_output;
+			}
+		}
+		if (!output) {
+			output = wlr_output_layout_output_at(server->output_layout,
+					server->cursor->x, server->cursor->y);
+		}
+		if (!output) {
+			return;
+		}
+		struct wlr_box box;
+		wlr_output_layout_get_box(server->output_layout, output, &box);
+		view->saved.x = view->x;
+		view->saved.y = view->y;
+		view->saved.width = view->width;
+		view->saved.height = view->height;
+		// Nothing may be drawn above the view for direct scanout to kick in
+		wlr_scene_node_reparent(&view->scene_tree->node, server->fullscreen_tree);
+		wio_view_move(view, box.x, box.y);
+		wlr_xdg_toplevel_set_size(view->xdg_toplevel, box.width, box.height);
+	} else {
+		wlr_scene_node_reparent(&view->scene_tree->node, server->view_tree);
+		wio_view_move(view, view->saved.x, view->saved.y);
+		wlr_xdg_toplevel_set_size(view->xdg_toplevel,
+				view->saved.width, view->saved.height);
+	}
+	view->fullscreen = fullscreen;
+	view_update_outputs(view);
+	// Reparenting put it on top of its new tree
+	view_raise(view);
+	for (size_t i = 0; i < countof(view->borders); ++i) {
+		wlr_scene_node_set_enabled(&view->borders[i]->node, !fullscreen);
 	}
+	wlr_xdg_toplevel_set_fullscreen(view->xdg_toplevel, fullscreen);
+	wio_update_occlusion(server);
 }
 
 struct wlr_box wio_which_box(struct wio_server *server) {
@@ -238,8 +937,8 @@ struct wlr_box wio_which_box(struct wio_server *server) {
 	if (server->interactive.view == NULL) {
 		goto End;
 	}
-	x2 = server->interactive.sx + server->interactive.view->xdg_toplevel->base->surface->current.width;
-	y2 = server->interactive.sy + server->interactive.view->xdg_toplevel->base->surface->current.height;
+	x2 = server->interactive.sx + server->interactive.view->width;
+	y2 = server->interactive.sy + server->interactive.view->height;
 	switch (server->interactive.view->area) {
 	case VIEW_AREA_BORDER_TOP_LEFT:
 		y1 = server->cursor->y;